@@ -4,56 +4,998 @@
  * License: GPL v3
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <ncurses.h>
+#include <zlib.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
-#define MAX_TODOS 100
-#define MAX_LENGTH 128
+#define MAX_LENGTH 128 // Longest text accepted from a prompt
+#define INITIAL_TODO_CAPACITY 64
+#define INITIAL_POOL_CAPACITY 4096
+#define INITIAL_CATEGORY_CAPACITY 16
+#define CATEGORY_NONE 0 // Id of the empty category every todo starts in
+#define INITIAL_TRIGRAM_BUCKETS 4096
+#define TRIGRAM_LEN 3 // Search terms shorter than this fall back to a scan
+#define INDEX_MAX_WORKERS 16
+#define INDEX_MIN_PARTITION 16384 // Fewest records worth a thread of their own
+#define SCAN_CHUNK 4096 // Slots per unit of scan work; their hot columns fit in L2
+#define SCAN_MIN_PARALLEL 65536 // Fewest slots worth waking the scan pool for
+#define TODO_DELETED 0x1 // Todo.flags: tombstone left by a delete until compaction
+#define REPEAT_SHIFT 8   // Todo.flags above the low byte: the recurrence rule
+#define REPEAT_MAX 999   // Most units between occurrences
+#define REPEAT_DAY_SHIFT 12 // Rule bits above the count: a monthly series' day of the month
+#define COMPACT_MIN_DELETED 1024 // Tombstones before they may force a compaction
+#define DAY_SECONDS (24 * 60 * 60)
+#define DATE_LENGTH 11 // "YYYY-MM-DD" and its NUL
+#define REPEAT_LENGTH 8 // "monthly" or "999m" and its NUL
+#define DATE_CACHE_SIZE 64
 #define DATA_FILE ".todos.dat"
+#define JOURNAL_FILE ".todos.journal"
+#define ARCHIVE_FILE ".todos.archive"
+#define STORE_MAGIC 0x4d4f4454   // "TDOM", memory-mapped data file
+#define STORE_VERSION 4 // Older records lack the uid or the creation time and are converted on load
+#define STORE_BYTE_ORDER 0x01020304
+#define STREAM_MAGIC 0x534f4454  // "TDOS", length-prefixed data file before version 1
+#define JOURNAL_MAGIC 0x4a4f4454 // "TDOJ"
+#define ARCHIVE_MAGIC 0x41444f54 // "TDOA", header of each archive block
+#define ARCHIVE_AGE_DAYS 30          // Since a done todo's creation and due date
+#define ARCHIVE_BLOCK_TODOS 1024     // Todos per archive block
+#define ARCHIVE_MIN_TODOS 1024       // Fewest archivable todos worth a new snapshot
+#define ARCHIVE_SLACK (1 << 20)      // Bytes of dropped blocks tolerated before rewriting the archive
+#define JOURNAL_VERSION 1 // Version 0 records named todos by slot
+#define JOURNAL_SYNC_BATCH 32         // Records written between fsyncs
+#define JOURNAL_COMPACT_RECORDS 4096  // Records before the log is folded into a snapshot
+#define JOURNAL_MAX_PAYLOAD (64 << 20)
+#define PERSIST_RING_SIZE (1 << 20) // Bytes of journal records queued for the persister
+#define PERSIST_SYNC_MS 1000 // Default fsync interval, overridden by $TODO_SYNC_MS
+#define PERSIST_POLL_MS 1000 // How often other instances' changes are polled without inotify
+#define INITIAL_UID_BUCKETS 1024
+#define IMPORT_CHUNK (1 << 20) // Read buffer for imports
+#define IMPORT_LINE_MAX 4096   // Longer import lines are skipped as malformed
+#define IMPORT_FIELDS 5        // text, category, due, done, repeat
+#define BATCH_REINDEX_MIN 256 // Batches this large rebuild an index instead of patching it
+#define QUERY_MAX_TERMS 16 // Per expression; the quick filters add up to QUICK_FILTER_TERMS
+#define QUICK_FILTER_TERMS 4
+#define TEXT_CHECK_COST 16 // A substring search, relative to comparing a field
+#define SOCKET_FILE ".todos.sock"
+#define SERVE_MAX_CLIENTS 256
+#define WIRE_MAX_PAYLOAD (1 << 20)
+#define WIRE_PAGE_BYTES (64 << 10) // Query rows are streamed in frames of about this size
+#define HISTORY_BUDGET (8 << 20) // Bytes of undo records kept; the oldest steps go first
+#define DUE_SOON_SECONDS (2 * DAY_SECONDS) // Due dates this close are drawn in pair 3
+#define REDRAW_RETRY_MS 1000 // Wait for the index thread before timing the next redraw
+#define BENCH_RUNS 10
+#define BENCH_CATEGORIES 40
+#define BENCH_DELETES 1000
+#define BENCH_DRAWS 200
+
+// Building with -DTODO_PROFILE times the hot paths for the 'i' overlay and
+// for --profile=FILE; otherwise the probes compile to nothing
+#ifdef TODO_PROFILE
+#define PROFILE_BEGIN(name) int64_t profile_##name = profile_clock()
+#define PROFILE_END(name, span) profile_span_add(span, profile_clock() - profile_##name)
+#define PROFILE_COUNT(counter, n) atomic_fetch_add_explicit(&counter, n, memory_order_relaxed)
+#else
+#define PROFILE_BEGIN(name)
+#define PROFILE_END(name, span)
+#define PROFILE_COUNT(counter, n)
+#endif
+
+// Strings live in string_pool; a Todo only records where its text starts
+// and how long it is. Offset 0 is a shared empty string. The layout is fixed
+// width because the data file stores the record table as-is.
+//
+// Slots differ between instances sharing the data file, so the journal
+// names a todo by its uid: the random nonce of the instance that created it
+// in the high half, a counter in the low half. Todos from files that
+// predate uids get their slot + 1, under nonce 0, and those that predate
+// creation times were created at 0.
+typedef struct {
+    int64_t due_date;
+    uint64_t uid;
+    int64_t created_at;
+    uint32_t text_off;
+    uint16_t text_len;
+    uint16_t category_id;
+    int32_t done;
+    uint32_t flags;
+} Todo;
+
+// Record layout of version 2 data files
+typedef struct {
+    int64_t due_date;
+    uint64_t uid;
+    uint32_t text_off;
+    uint16_t text_len;
+    uint16_t category_id;
+    int32_t done;
+    uint32_t flags;
+} TodoV2;
+
+// Record layout of version 1 data files
+typedef struct {
+    int64_t due_date;
+    uint32_t text_off;
+    uint16_t text_len;
+    uint16_t category_id;
+    int32_t done;
+    uint32_t flags;
+} TodoV1;
+
+// Data file header. The record table, category table and string heap follow
+// at the given offsets in their in-memory layout, so load_todos() maps the
+// file and points todos, categories and string_pool straight into it. The
+// archive table lists the archive blocks that hold the rest of the todos.
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t byte_order;
+    uint16_t record_size;
+    uint16_t category_size;
+    uint64_t generation;
+    uint64_t record_count;
+    uint64_t records_offset;
+    uint64_t category_count;
+    uint64_t categories_offset;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint64_t archive_count;
+    uint64_t archive_offset;
+    uint32_t checksum; // Over the header fields before it
+    uint32_t pad;
+} StoreHeader;
+
+// Header of data files before version 4, which had no archive table
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t byte_order;
+    uint16_t record_size;
+    uint16_t category_size;
+    uint64_t generation;
+    uint64_t record_count;
+    uint64_t records_offset;
+    uint64_t category_count;
+    uint64_t categories_offset;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint32_t checksum;
+    uint32_t pad;
+} StoreHeaderV3;
+
+// Done todos created and due more than ARCHIVE_AGE_DAYS ago leave the
+// store for the archive file at the start of a session, ARCHIVE_BLOCK_TODOS
+// to a zlib-compressed block. A block's payload is a restore record's:
+// a RestoreEntry per todo, each followed by its text and category name.
+// Views read a block only when they ask for done todos or search, and only
+// if its due date range and its Bloom filter of category names let it hold
+// a match. The TUI moves the todos of a block it reads back into the store;
+// headless commands read them in place.
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum; // Over the rest of the header and the payload
+    uint64_t id;
+    uint64_t bloom;    // Two bits per category name, from hash_key()
+    int64_t due_min;   // Range of the dated todos; due_min > due_max if none
+    int64_t due_max;
+    uint32_t count;
+    uint32_t undated;
+    uint32_t raw_size;
+    uint32_t packed_size;
+} ArchiveBlock;
+
+// Entry of the archive table: a block and where its header was written.
+// The snapshot carries the table, so the store and the archive blocks it
+// still relies on always change together.
+typedef struct {
+    ArchiveBlock block;
+    uint64_t offset;
+} ArchiveRef;
+
+enum { DUE_ALL, DUE_OVERDUE, DUE_UPCOMING };   // filter_due: pending todos past or not yet due
+// sort_mode: list order; due date, undated last; category name, uncategorized
+// last; text; creation time
+enum { SORT_NONE, SORT_DUE, SORT_CATEGORY, SORT_TEXT, SORT_CREATED, SORT_MODES };
+
+enum { FORMAT_LINES, FORMAT_CSV, FORMAT_JSONL };
+enum { INDEX_TRIGRAM = 1, INDEX_DUE = 2 };
+
+// Messages to the persister that are not journal records. Their payload is
+// a pointer: to a record too large for the ring, or to a store snapshot.
+enum { PERSIST_RECORD = 0xf0, PERSIST_SNAPSHOT, PERSIST_STOP };
+
+// Journal operations; each record replays one store_* call. Batch records
+// apply one change to many todos: their uid field holds the count and the
+// payload the uids, followed by the category name if any. A restore record,
+// written by undo, brings back deleted todos: its payload holds a
+// RestoreEntry per todo, each followed by its text and category name. A
+// thaw record moves the todos of the archive block whose id is its value
+// back into the store.
+enum {
+    OP_ADD = 1, OP_DELETE, OP_DONE, OP_TEXT, OP_DUE, OP_CATEGORY, OP_PURGE_DONE,
+    OP_BATCH_DELETE, OP_BATCH_DONE, OP_BATCH_DUE, OP_BATCH_CATEGORY, OP_BATCH_RESTORE,
+    OP_REPEAT, OP_BATCH_REPEAT, OP_THAW
+};
+
+// Recurrence rule of a series, kept in Todo.flags: the unit in the low two
+// bits and the number of units between occurrences above them; 0 if the
+// todo does not repeat. A series is a single todo standing for its next
+// occurrence, so however far ahead a view looks it shows one row per series.
+enum { REPEAT_NONE, REPEAT_DAYS, REPEAT_WEEKS, REPEAT_MONTHS };
+
+typedef struct {
+    uint64_t uid;
+    int64_t created_at;
+    int64_t due_date;
+    uint16_t text_len;
+    uint16_t category_len;
+    uint32_t repeat;
+    uint8_t done;
+    uint8_t pad[7];
+} RestoreEntry;
+
+// Undo history. Each step holds the journal records that undo one command,
+// then those that redo it; they name todos by uid and carry only the fields
+// the command changed, so undoing a batch is one pass over it.
+typedef struct {
+    char *data;
+    size_t undo_size;
+    size_t redo_size;
+} HistoryStep;
+
+// Records of the command being run, until history_commit()
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} HistoryBuffer;
+
+enum { HISTORY_UNDO, HISTORY_REDO };
+
+typedef struct {
+    int64_t key;
+    int idx;
+} HistoryGroup;
+
+// Journal record header, followed by length bytes of payload (the text or
+// category name). checksum covers the rest of the header and the payload, so
+// a torn write at the tail is detected and dropped on replay.
+typedef struct {
+    uint32_t length;
+    uint32_t checksum;
+    int64_t value; // Done flag or due date
+    uint64_t uid;
+    uint8_t op;
+    uint8_t pad[7];
+} JournalRecord;
+
+// Record header of version 0 journals, whose idx was a slot
+typedef struct {
+    uint32_t length;
+    uint32_t checksum;
+    int64_t value;
+    int32_t idx;
+    uint8_t op;
+    uint8_t pad[3];
+} JournalRecordV0;
+
+// Header at the start of the journal file
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation; // Snapshot the records apply on top of
+} JournalHeader;
+
+// Growable array of todo indices
+typedef struct {
+    int *items;
+    int count;
+    int capacity;
+} IndexList;
+
+// One condition of a filter expression, all of which must hold:
+//   done, pending          todos that are (not) done
+//   overdue, upcoming      pending todos due before / from now
+//   cat:NAME               todos in category NAME (cat:"" for none)
+//   due<7d, due>=2026-11-01, due=today, due=none
+//                          due dates against a date or days (d) or weeks
+//                          (w) from now; = matches the whole day
+//   word, "some words"     text or category contains the words
+// Any term but overdue and upcoming can be negated with a leading !.
+enum { TERM_DONE, TERM_CATEGORY, TERM_DUE, TERM_TEXT };
+
+typedef struct {
+    uint8_t kind;
+    uint8_t negate;
+    uint8_t relative; // TERM_DUE: value is seconds from now rather than a date
+    char op;          // TERM_DUE: '<', '>', '=', 'l' (<=), 'g' (>=) or 'n' (undated)
+    int category_id;  // TERM_CATEGORY: resolved from text when planned
+    int64_t value;
+    int64_t lo, hi;   // TERM_DUE: due dates that match, [lo, hi), resolved when planned
+    double pass;      // Estimated share of todos that pass, from the indexes
+    size_t text_len;  // TERM_TEXT: text is folded to lower case when planned
+    char text[MAX_LENGTH];
+} QueryTerm;
+
+typedef struct {
+    QueryTerm terms[QUERY_MAX_TERMS + QUICK_FILTER_TERMS];
+    int count;
+} Query;
+
+// Where a plan takes its candidates from before the per-row checks
+enum { PLAN_SCAN, PLAN_DUE, PLAN_TRIGRAM, PLAN_EMPTY };
+
+typedef struct {
+    Query query;
+    int source;
+    int first, last;  // PLAN_DUE: due-index range
+    int search;       // PLAN_TRIGRAM: text term whose trigrams give the candidates
+    int checks[QUERY_MAX_TERMS + QUICK_FILTER_TERMS]; // Terms left to check, cheapest rejection first
+    int check_count;
+} QueryPlan;
+
+// Posting list of the todos whose text or category contains a trigram
+typedef struct {
+    uint32_t trigram; // Three case-folded bytes; 0 marks an empty bucket
+    IndexList todos;  // Sorted todo indices
+} TrigramEntry;
+
+typedef struct {
+    TrigramEntry *entries; // Open-addressed by trigram
+    int buckets;
+    int count;
+} TrigramTable;
+
+// Entry of the due-date index, ordered by due date and then todo index
+typedef struct {
+    int64_t due_date;
+    int idx;
+} DueEntry;
+
+// One worker's share of an index build: partial indexes over a slot range
+typedef struct {
+    int first, last;
+    int which;
+    TrigramTable trigrams;
+    DueEntry *due;
+    int due_count;
+} IndexPartition;
+
+// Chunks of a pooled scan not yet claimed. The owner takes from the head,
+// idle workers steal from the tail.
+typedef struct {
+    pthread_mutex_t lock;
+    int head, tail;
+} ScanQueue;
+
+// Memoized format_date() result for one due date
+typedef struct {
+    int64_t date;
+    char text[DATE_LENGTH];
+} DateCacheEntry;
+
+typedef struct {
+    int total;
+    int done;
+} CategoryCount;
+
+// Interned category; key is the case-folded name used for lookups
+typedef struct {
+    uint32_t name_off;
+    uint32_t key_off;
+    uint16_t name_len;
+    uint16_t pad;
+    uint32_t hash;
+} Category;
+
+// The arrays save_todos() writes: the live store, or a copy of it taken for
+// the persister
+typedef struct {
+    const Todo *todos;
+    int todo_count;
+    const Category *categories;
+    int category_count;
+    const char *pool;
+    size_t pool_size;
+    const ArchiveRef *archive;
+    int archive_count;
+    uint64_t generation;
+    size_t foreign_applied; // Bytes of other instances' records in the copy
+} StoreImage;
 
+// Record layout written by the fixed-array version, kept to read old files
 typedef struct {
     char text[MAX_LENGTH];
     char category[MAX_LENGTH];
     time_t due_date;
     int done;
-} Todo;
+} LegacyTodo;
+
+// Frame of the daemon protocol, followed by length payload bytes. A client
+// may send any number of requests without waiting; they are answered in
+// order, each reply echoing the tag of its request.
+typedef struct {
+    uint32_t length;
+    uint32_t tag;
+    int64_t value;
+    uint8_t op;
+    uint8_t pad[7];
+} WireFrame;
+
+// Requests:
+//   WIRE_ADD       value: due date; payload: text, NUL, category, then for
+//                  a series NUL and its uint32 recurrence rule
+//   WIRE_SET_DONE  value: 0 or 1; payload: uint64 ids
+//   WIRE_DELETE    payload: uint64 ids
+//   WIRE_QUERY     payload: WireQuery, category, search term, expression
+// Replies:
+//   WIRE_OK        value: id added, or rows sent by a query
+//   WIRE_ERROR     value: the id that does not exist, or 0
+//   WIRE_ROWS      value: rows in the frame; payload: packed rows of
+//                  uint64 id, int64 due date, uint8 done, uint16 text and
+//                  uint16 category lengths, uint32 recurrence rule, then the
+//                  text and the category
+// An id is a todo's uid.
+enum { WIRE_ADD = 1, WIRE_SET_DONE, WIRE_DELETE, WIRE_QUERY };
+enum { WIRE_OK = 0x80, WIRE_ERROR, WIRE_ROWS };
+
+#define WIRE_ROW_HEADER 25
+// WireQuery.flags: list the archived todos the filters pass even unasked, as export does
+#define WIRE_QUERY_ARCHIVE 0x1
 
-Todo todos[MAX_TODOS];
-int todo_count = 0;
-int selected = 0;
+typedef struct {
+    int8_t done;    // filter_done
+    int8_t due;     // filter_due
+    int8_t sort;    // sort_mode
+    uint8_t flags;
+    uint16_t category_len;
+    uint16_t search_len;
+    uint16_t query_len;
+} WireQuery;
+
+// A connection to the daemon. The rows of a query are kept as uids and
+// sent a page at a time as the client reads them, so a compaction or a
+// delete in between cannot point a later page at the wrong todo.
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_size;
+    size_t in_capacity;
+    char *out;
+    size_t out_size;
+    size_t out_sent;
+    size_t out_capacity;
+    uint64_t *rows; // Query being streamed, if streaming
+    int row_count;
+    int row_pos;
+    int rows_sent;
+    Query query;      // Its resolved terms, which the archived todos are checked against
+    uint64_t *blocks; // Ids of the archive blocks that may hold more of its rows
+    int block_count;
+    int block_pos;
+    uint32_t row_tag;
+    int streaming;
+} Client;
+
+Todo *todos = NULL;
+int todo_count = 0;   // Slots in use, tombstones included
+int todo_capacity = 0;
+int deleted_count = 0; // Tombstoned slots awaiting compaction
+char *string_pool = NULL;
+size_t pool_size = 0;
+size_t pool_capacity = 0;
+Category *categories = NULL;
+int category_count = 0;
+int category_capacity = 0;
+int *category_buckets = NULL; // Open-addressed hash of category ids, -1 if empty
+int bucket_count = 0;
+char *map_base = NULL; // Private mapping of the data file, if it was mapped
+size_t map_size = 0;
+int *uid_table = NULL; // Open-addressed slots by Todo.uid, -1 if empty
+int uid_buckets = 0;
+int uid_ready = 0; // Built by the first journal record that names a todo
+uint64_t uid_nonce = 0;
+uint32_t uid_counter = 0;
+TrigramTable trigrams = {0};
+int trigram_ready = 0; // The index is built by the first search that needs it
+DueEntry *due_index = NULL; // Every dated todo, sorted
+int due_count = 0;
+int due_capacity = 0;
+int due_ready = 0; // Built by the first view that needs it, like the trigram index
+// Copies of the fields the filters test, one dense column each, so a scan
+// reads only the columns its terms need instead of whole records. Slot i
+// is bit i % 64 of word i / 64 in the bitmaps. Built by the first scan,
+// then kept in step by the store_*() mutations.
+uint64_t *done_bits = NULL;
+uint64_t *deleted_bits = NULL;
+uint16_t *category_column = NULL;
+int64_t *due_column = NULL;
+int column_capacity = 0;
+int columns_ready = 0;
+// Counts of live todos for the header and the category picker, built by
+// the first frame and then kept in step by the store_*() mutations. A
+// pending todo counts as overdue if due before overdue_now, which
+// advance_overdue() moves with the clock through the due index.
+CategoryCount *category_counts = NULL; // By category id
+int category_counts_capacity = 0;
+int done_total = 0;
+int overdue_total = 0;
+time_t overdue_now = 0;
+int counters_ready = 0;
+// Every slot, tombstones included, in the order of each sort but list and
+// due order, which come from the slots and the due index. Each is built by
+// the first view sorted that way and then kept in order by binary insertion.
+IndexList sort_orders[SORT_MODES] = {{0}};
+int sort_ready[SORT_MODES] = {0};
+int sorting_mode = SORT_NONE; // Order compare_sorted() sorts in
+// Case-folded first 8 bytes of texts and category names, compared as
+// integers before falling back to strcasecmp()
+uint64_t *text_keys = NULL;
+int text_key_capacity = 0;
+int text_keys_ready = 0;
+uint64_t *category_keys = NULL;
+int category_key_count = 0;
+int view_categories = 0; // Categories when the view was planned
+pthread_t index_thread; // Builds both indexes after startup on large stores
+int index_thread_running = 0; // Only read and written by the UI thread
+atomic_int index_thread_done;
+// Threads that scan chunks of a long slot range beside the UI thread,
+// started by the first such scan and kept for the rest of the run.
+// scan_job is bumped under scan_lock to hand them each scan.
+pthread_t scan_threads[INDEX_MAX_WORKERS];
+int scan_workers = 0; // Not counting the thread that asked for the scan
+int scan_pool_started = 0;
+pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scan_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t scan_done = PTHREAD_COND_INITIALIZER;
+uint64_t scan_job = 0;
+int scan_busy = 0;     // Workers still on the current job
+ScanQueue scan_queues[INDEX_MAX_WORKERS];
+IndexList *scan_results = NULL; // Matches of each chunk, merged in chunk order
+long *scan_counts = NULL;       // Live slots each chunk tested, for the profiler
+int scan_result_capacity = 0;
+int scan_first = 0, scan_last = 0; // Slot range of the current job
+IndexList marked = {0}; // Sorted slots picked for a batch command
+IndexList view = {0}; // Todo indices that pass the current filters, in order
+int view_dirty = 1;
+time_t rows_drawn_at = 0; // The now the visible rows were coloured for
+// An unsorted scan in the TUI stops once it fills the screen; the view then
+// holds only the matches below view_next, and stream_view() scans on as the
+// selection nears its end
+int view_stream = 0;
+int view_streaming = 0;
+int view_next = 0;
+int selected = 0;   // Position in view of the highlighted todo
+int scroll_top = 0; // Position in view of the first row drawn
 char filter_category[MAX_LENGTH] = "";
+char filter_query[MAX_LENGTH] = ""; // Filter expression, on top of the quick filters
+Query filter_terms = {0}; // filter_query, compiled
+QueryPlan view_plan; // Planned by refresh_view() from the filters
 int filter_done = -1; // -1: all, 0: pending, 1: done
+int filter_due = DUE_ALL;
+int sort_mode = SORT_NONE;
+time_t view_now = 0; // Time the view was built; the due filter is relative to it
 char search_term[MAX_LENGTH] = "";
+FILE *journal = NULL;
+uint64_t store_generation = 0; // Bumped by every snapshot
+int journal_records = 0;       // Records since the last snapshot
+int journal_unsynced = 0;      // Records written since the last fsync
+ArchiveRef *archive = NULL; // The archive table of the store
+int archive_count = 0;
+int archive_capacity = 0;
+long archived_todos = 0;    // Todos in its blocks
+int archive_fd = -1;        // ARCHIVE_FILE, opened on first use
+int view_archive = 0;       // Export: archived todos the filters pass are listed even unasked
+int view_thaws = 0;         // The TUI thaws the archived todos a view may show, so they can be
+                            // edited; headless commands read them in place
+// Archive blocks none of whose todos contain miss_terms, the folded positive
+// text terms of the last query that read the archive; sorted by id
+uint64_t *archive_misses = NULL;
+int archive_miss_count = 0;
+int archive_miss_capacity = 0;
+char miss_terms[QUERY_MAX_TERMS + QUICK_FILTER_TERMS][MAX_LENGTH];
+size_t miss_term_lens[QUERY_MAX_TERMS + QUICK_FILTER_TERMS];
+int miss_term_count = 0;
+// While the persister runs it owns the journal file; the UI thread only
+// queues records in a single-producer, single-consumer ring
+pthread_t persist_thread;
+int persist_running = 0;
+int persist_wake[2] = {-1, -1}; // Pipe the UI thread pokes when the persister sleeps
+int persist_sync_ms = PERSIST_SYNC_MS;
+char persist_ring[PERSIST_RING_SIZE];
+atomic_size_t persist_head; // Bytes ever queued, advanced by the UI thread
+atomic_size_t persist_tail; // Bytes ever consumed, advanced by the persister
+atomic_int persist_idle;
+// Other instances append to the same journal under its lock. The persister
+// reads their records past journal_pos and hands them to the UI thread in
+// the inbox, poking persist_notify.
+long journal_pos = 0;
+uint64_t journal_generation = 0; // The persister's copy of store_generation
+int persist_stale = 0; // The journal was reset under us; our snapshots would lose records
+int persist_watch = -1; // inotify on the journal, or -1 to poll
+int persist_notify[2] = {-1, -1};
+pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+char *inbox = NULL;
+size_t inbox_size = 0;
+size_t inbox_capacity = 0;
+int inbox_reload = 0;       // Another instance took a snapshot: reload everything
+size_t foreign_forwarded = 0; // Inbox bytes ever queued, under inbox_lock
+size_t foreign_applied = 0;   // Of those, bytes applied by the UI thread
+int server_fd = -1; // Daemon a scripted command is forwarded to, if one serves this directory
+uint32_t wire_tag = 0;
+volatile sig_atomic_t serve_stop = 0;
+HistoryStep *history = NULL;
+int history_count = 0; // Steps kept
+int history_pos = 0;   // Steps applied; the ones after it can be redone
+int history_capacity = 0;
+size_t history_bytes = 0;
+HistoryBuffer history_pending[2]; // By HISTORY_UNDO and HISTORY_REDO
+uint64_t bench_state = 1; // xorshift64 state, from --seed
+// Case-insensitive substring search for a needle folded by fold_ascii(),
+// the widest variant the CPU runs; picked by select_matcher() at startup
+int (*find_folded)(const char *hay, size_t hay_len, const char *needle, size_t len) = NULL;
+
+#ifdef TODO_PROFILE
+enum { SPAN_FRAME, SPAN_FILTER, SPAN_SEARCH, SPAN_PERSIST, PROFILE_SPANS };
+
+// Each span is only added to by one thread; the overlay reads the
+// persister's from the UI thread
+typedef struct {
+    atomic_llong count;
+    atomic_llong total_ns;
+    atomic_llong last_ns;
+    atomic_llong max_ns;
+} ProfileSpan;
+
+ProfileSpan profile_spans[PROFILE_SPANS];
+atomic_llong profile_scanned; // Todos checked against the filters
+atomic_llong profile_bytes;   // Journal records and snapshots written
+long long profile_frame_scanned = 0; // During the last frame
+int profile_frame_drawn = 0;
+int profile_overlay = 0;
+const char *profile_file = NULL;
+#endif
 
 // Function prototypes
 void init_screen();
-void save_todos();
+void init_store();
+void *xrealloc(void *ptr, size_t size);
+void *grow_buffer(void *ptr, size_t used, size_t size);
+uint32_t pool_add(const char *str, size_t len);
+const char* todo_text(int idx);
+const char* todo_category(int idx);
+Todo* new_todo();
+uint64_t next_uid();
+void build_uid_map();
+void uid_insert(int idx);
+int find_todo(uint64_t uid);
+int find_slot(uint64_t uid);
+int store_restore(const RestoreEntry *entry, const char *text, const char *category);
+int store_add(const char *text, size_t len, uint64_t uid, int64_t created_at);
+void store_delete(int idx);
+void store_set_done(int idx, int done);
+void store_set_text(int idx, const char *text, size_t len);
+void store_set_due_date(int idx, time_t due_date);
+void store_set_category(int idx, const char *name, size_t len);
+void store_set_repeat(int idx, uint32_t repeat);
+void store_purge_done();
+void store_batch(int op, const int *slots, int count, int64_t value, const char *name, size_t len);
+void unmark_deleted();
+void compact_store();
+void remap_list(IndexList *list, const int *remap);
+uint32_t hash_key(const char *key, size_t len);
+void grow_category_buckets();
+int find_category(const char *name);
+int intern_category(const char *name, size_t len);
+const char* category_name(int id);
+int load_legacy_todos(FILE *file, long start, int count);
+int save_todos(const StoreImage *image);
+StoreImage live_image();
+StoreImage* snapshot_store();
 void load_todos();
+void open_store();
+void reset_store();
+void reload_store();
+int map_store(int fd, size_t size);
+int valid_store(const StoreHeader *header, size_t size);
+int valid_records(const Todo *records, const StoreHeader *header);
+void load_stream_todos(FILE *file);
+uint32_t checksum(const void *data, size_t len, uint32_t hash);
+uint32_t record_checksum(const JournalRecord *rec, const char *payload);
+int read_record(FILE *file, int version, JournalRecord *rec, char **payload, size_t *capacity);
+void open_journal();
+int replay_record(const JournalRecord *rec, const char *payload);
+int restore_entries(const char *payload, size_t length, uint64_t count, int revive);
+void reset_journal(uint64_t generation);
+void sync_journal();
+void journal_write(int op, int idx, int64_t value, const char *data, size_t len);
+void journal_append(int op, uint64_t uid, int64_t value, const char *data, size_t len);
+void start_persister();
+void stop_persister();
+void persist_push(const JournalRecord *rec, const void *payload);
+void persist_read(size_t pos, void *data, size_t len);
+int persist_drain();
+void* persister_main(void *arg);
+int read_foreign_records(int exclusive);
+void inbox_push(const JournalRecord *rec, const char *payload);
+void apply_foreign_records();
+int read_key();
+int redraw_timeout();
+int64_t next_crossing(int64_t now, int64_t offset, int64_t wake, int pending);
+int due_colour(int idx, time_t now);
+void redraw_due();
+void journal_write_batch(int op, const int *slots, int count, int64_t value,
+                         const char *name, size_t len);
+int compact_journal();
+void close_journal();
+void archive_done_todos();
+int compare_due_slots(const void *a, const void *b);
+int append_archive_block(const int *slots, int count);
+uint32_t block_checksum(const ArchiveBlock *block, const char *payload);
+uint64_t category_bloom(const char *name, size_t len);
+int open_archive();
+int load_archive_block(const ArchiveRef *ref, char **data, size_t *capacity);
+int thaw_block(int n);
+const char* unpack_block(int n);
+void restore_block(int n, const char *raw);
+int block_has_text(const ArchiveBlock *block, const char *raw, int count);
+const char* next_archive_entry(const char *raw, size_t size, size_t *pos, RestoreEntry *entry);
+int entry_matches(const Query *query, const RestoreEntry *entry, const char *text);
+int view_reads_archive();
+void print_archived(int format);
+int thaw_todo(uint64_t uid);
+int text_terms(const Query *query);
+int archive_missed(uint64_t id);
+void add_archive_miss(uint64_t id);
+int thaw_archive(const Query *query, time_t now);
+int query_reads_archive(const Query *query);
+int block_may_match(const ArchiveBlock *block, const Query *query, time_t now);
+int rewrite_archive();
 void draw_screen();
+void draw_todo_row(int y, int pos, time_t now);
+void draw_counts(time_t now);
+void list_push(IndexList *list, int value);
+void list_copy(IndexList *dst, const IndexList *src);
+void list_append(IndexList *dst, const IndexList *src);
+void list_insert_sorted(IndexList *list, int value);
+void list_remove_sorted(IndexList *list, int value);
+int list_contains_sorted(const IndexList *list, int value);
+uint32_t make_trigram(const char *str);
+IndexList* trigram_postings(TrigramTable *table, uint32_t trigram, int create);
+void grow_trigram_table(TrigramTable *table);
+void index_string(TrigramTable *table, const char *str, size_t len, int idx, int add);
+void index_todo_trigrams(TrigramTable *table, int idx, int add);
+void build_indexes(int which);
+void* build_partition(void *arg);
+void merge_trigrams(IndexPartition *parts, int count);
+void merge_due(IndexPartition *parts, int count);
+void* index_thread_main(void *arg);
+void start_index_build();
+int index_build_pending();
+void finish_index_build();
+void build_trigram_index();
+void drop_trigram_index();
+void index_todo(int idx);
+void unindex_todo(int idx);
+int trigram_candidates(const char *term, IndexList *out);
+void build_due_index();
+int compare_due_entry(const void *a, const void *b);
+int due_lower_bound(int64_t due_date, int idx);
+void due_insert(int64_t due_date, int idx);
+void due_remove(int64_t due_date, int idx);
+int compare_index(const void *a, const void *b);
+int compare_todos(int x, int y, int mode);
+int compare_sorted(const void *a, const void *b);
+void sort_indices(IndexList *list);
+uint64_t sort_key(const char *str);
+void update_category_keys();
+void prepare_sort_keys(int mode, int all);
+void build_sort_order(int mode);
+void drop_sort_orders();
+int sort_position(const IndexList *list, int idx, int mode);
+void sort_insert(int mode, int idx);
+void sort_remove(int mode, int idx);
+void view_update(int idx);
+int view_find(int idx);
+int todo_matches_plan(int idx);
+void filter_by_due();
+void toggle_sort();
+void invalidate_view();
+void view_remove(int idx);
+const char* sort_name(int mode);
+void refresh_view();
+int command_targets(int **slots);
+void toggle_mark();
+void mark_all();
 void add_todo();
-void delete_todo(int idx);
-void toggle_todo(int idx);
+void delete_todos(const int *slots, int count);
+void purge_done();
+void toggle_todos(const int *slots, int count);
 void edit_todo(int idx);
-void set_due_date(int idx);
-void set_category(int idx);
+void history_record(int side, int op, uint64_t uid, int64_t value, const char *data, size_t len);
+void history_batch(int side, int op, const int *slots, int count, int64_t value,
+                   const char *name, size_t len);
+void history_restore(int side, const int *slots, int count);
+size_t pack_todos(const int *slots, int count, char **payload, size_t *capacity);
+void history_grouped(int op, const int *slots, int count);
+void history_commit();
+void apply_history(const char *records, size_t size);
+void undo();
+void redo();
+int compare_history_group(const void *a, const void *b);
+void set_due_date(const int *slots, int count);
+void set_category(const int *slots, int count);
+void set_repeat(const int *slots, int count);
 void filter_by_category();
 void filter_by_status();
 void search_todos();
-char* format_date(time_t date);
+void full_view(IndexList *level);
+int parse_date(const char *str, time_t *date);
+void format_date(time_t date, char *buffer);
+int parse_repeat(const char *str, uint32_t *repeat);
+void format_repeat(uint32_t repeat, char *buffer);
+uint32_t todo_repeat(int idx);
+int valid_repeat(uint32_t repeat);
+time_t next_occurrence(time_t due_date, uint32_t repeat, time_t now);
+time_t start_of_day(time_t now);
+int days_in_month(int year, int month);
 int todo_matches_filter(int idx);
+void build_columns();
+void update_columns(int idx);
+void scan_view(IndexList *out);
+void stream_view(int rows);
+void scan_slots(IndexList *out, int first, int last);
+long scan_pooled(IndexList *out, int first, int last);
+long scan_range(IndexList *out, int first, int last);
+int start_scan_pool();
+void* scan_worker(void *arg);
+void run_scan_queue(int self);
+int claim_scan_chunk(int self);
+uint64_t column_mask(const QueryTerm *term, int base, int rows);
+void build_counters(time_t now);
+void count_todo(int idx, int sign);
+void advance_overdue(time_t now);
+int compare_category_keys(const void *a, const void *b);
+int todo_contains(int idx, const char *needle, size_t len);
+void select_matcher();
+size_t fold_ascii(char *dst, const char *src);
+int fold_byte(unsigned char c);
+int folded_equal(const char *hay, const char *needle, size_t len);
+int find_folded_scalar(const char *hay, size_t hay_len, const char *needle, size_t len);
+#ifdef __x86_64__
+int block_readable(const char *p, size_t width);
+__m128i fold_sse2(__m128i x);
+__m256i fold_avx2(__m256i x);
+int find_folded_sse2(const char *hay, size_t hay_len, const char *needle, size_t len);
+int find_folded_avx2(const char *hay, size_t hay_len, const char *needle, size_t len);
+#endif
+int term_matches(const QueryTerm *term, int idx);
+void plan_view();
+QueryTerm* add_term(Query *query, int kind, int negate, const char *text);
+int compile_query(const char *text, Query *query, const char **error);
+int compile_due_term(QueryTerm *term, const char *str);
+void plan_query(QueryPlan *plan, time_t now);
+double check_rank(const QueryTerm *term);
+void resolve_due_term(QueryTerm *term, time_t now);
+int trigram_estimate(const char *term);
+void filter_by_query();
+int run_command(int argc, char **argv);
+int command_add(int argc, char **argv);
+int command_set_done(int argc, char **argv, int done);
+int command_delete(int argc, char **argv);
+int command_list(int argc, char **argv);
+int command_import(int argc, char **argv);
+int command_export(int argc, char **argv);
+int parse_list_option(const char *arg);
+int parse_format(const char *arg, int *format);
+int parse_csv_record(char *line, char **fields, size_t *lens);
+int parse_json_record(char *line, char **fields, size_t *lens);
+int parse_json_string(char **pos, char **value, size_t *len);
+int parse_hex4(const char *str, unsigned *code);
+int import_record(char **fields, size_t *lens);
+void write_csv_field(const char *str, FILE *out);
+void write_json_string(const char *str, FILE *out);
+int parse_todo_id(const char *arg);
+int add_record(const char *text, size_t len, const char *category, size_t category_len,
+               time_t due_date, uint32_t repeat);
+void complete_todo(int idx, int done);
+void print_todo(int format, uint64_t id, int done, int64_t due_date, uint32_t repeat,
+                const char *category, const char *text);
+int connect_server();
+int wire_write(int fd, const void *data, size_t len);
+int wire_read(int fd, void *data, size_t len);
+int wire_send(int fd, int op, int64_t value, const void *payload, size_t len);
+int wire_receive(int fd, WireFrame *frame, char **payload, size_t *capacity);
+uint64_t remote_add(const char *text, size_t len, const char *category, time_t due_date,
+                    uint32_t repeat);
+int remote_update(int op, int64_t value, int argc, char **argv);
+int remote_query(int format);
+void stop_serving(int sig);
+int command_serve();
+void client_reply(Client *c, int op, uint32_t tag, int64_t value, const void *payload, size_t len);
+void serve_request(Client *c, const WireFrame *frame, const char *payload);
+void serve_query(Client *c, const WireFrame *frame, const char *payload);
+void serve_rows(Client *c);
+size_t pack_row(char **page, size_t *capacity, size_t size, uint64_t uid, int64_t due_date, int done,
+                uint32_t repeat, const char *text, uint16_t text_len, const char *category,
+                uint16_t category_len);
+int serve_client(Client *c, short revents);
+void init_colors();
+int command_bench(int argc, char **argv);
+uint64_t bench_random();
+double bench_now();
+void bench_generate(int count);
+void bench_report(int todos, const char *name, double *samples, int count, int items);
+int compare_double(const void *a, const void *b);
+#ifdef TODO_PROFILE
+int64_t profile_clock();
+void profile_span_add(int span, int64_t ns);
+void draw_profile();
+void dump_profile();
+#endif
+void bench_filters(int todos, int runs, double *samples);
+void bench_draw(int todos, double *samples);
 
-int main() {
+int main(int argc, char **argv) {
+    select_matcher();
+#ifdef TODO_PROFILE
+    if (argc > 1 && strncmp(argv[1], "--profile=", 10) == 0) {
+        profile_file = argv[1] + 10;
+        argc--;
+        argv++;
+    }
+#endif
+    if (argc > 1) return run_command(argc - 1, argv + 1);
+
+    init_store();
     init_screen();
-    load_todos();
+    view_stream = 1;
+    view_thaws = 1;
+    open_store();
+    archive_done_todos();
+    if (journal) flock(fileno(journal), LOCK_UN);
+    start_index_build();
+    start_persister();
+    if (journal && !persist_running) {
+        endwin();
+        fprintf(stderr, "minimal-todo: cannot start the persister thread\n");
+        return 1;
+    }
 
-    int ch;
-    while ((ch = getch()) != 'q') {
+    draw_screen();
+
+    int ch, count;
+    int *slots;
+    while ((ch = read_key()) != 'q') {
         switch (ch) {
             case 'j': case KEY_DOWN:
-                if (selected < todo_count - 1) selected++;
+                if (selected < view.count - 1) selected++;
                 break;
             case 'k': case KEY_UP:
                 if (selected > 0) selected--;
@@ -61,41 +1003,80 @@ int main() {
             case 'a':
                 add_todo();
                 break;
+            case 'v':
+                if (view.count > 0) toggle_mark();
+                break;
+            case 'V':
+                mark_all();
+                break;
             case 'd':
-                if (todo_count > 0) delete_todo(selected);
+                if ((count = command_targets(&slots))) delete_todos(slots, count);
                 break;
             case ' ':
-                if (todo_count > 0) toggle_todo(selected);
+                if ((count = command_targets(&slots))) toggle_todos(slots, count);
                 break;
             case 'e':
-                if (todo_count > 0) edit_todo(selected);
+                if (view.count > 0) edit_todo(view.items[selected]);
                 break;
             case 'D':
-                if (todo_count > 0) set_due_date(selected);
+                if ((count = command_targets(&slots))) set_due_date(slots, count);
                 break;
             case 'c':
-                if (todo_count > 0) set_category(selected);
+                if ((count = command_targets(&slots))) set_category(slots, count);
+                break;
+            case 'R':
+                if ((count = command_targets(&slots))) set_repeat(slots, count);
                 break;
             case 'C':
                 filter_by_category();
                 break;
+            case 'F':
+                filter_by_query();
+                break;
             case 'f':
                 filter_by_status();
                 break;
+            case 'o':
+                filter_by_due();
+                break;
+            case 's':
+                toggle_sort();
+                break;
+            case 'P':
+                purge_done();
+                break;
             case '/':
                 search_todos();
                 break;
+#ifdef TODO_PROFILE
+            case 'i':
+                profile_overlay = !profile_overlay;
+                break;
+#endif
+            case 'u':
+                undo();
+                break;
+            case 'U':
+                redo();
+                break;
             case 'r': // Reset filters
                 filter_category[0] = '\0';
+                filter_query[0] = '\0';
+                filter_terms.count = 0;
                 filter_done = -1;
+                filter_due = DUE_ALL;
                 search_term[0] = '\0';
+                invalidate_view();
                 break;
         }
         draw_screen();
     }
 
-    save_todos();
+    close_journal();
     endwin();
+#ifdef TODO_PROFILE
+    if (profile_file) dump_profile();
+#endif
     return 0;
 }
 
@@ -104,6 +1085,11 @@ void init_screen() {
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
+    set_escdelay(25);
+    init_colors();
+}
+
+void init_colors() {
     start_color();
     init_pair(1, COLOR_GREEN, COLOR_BLACK);   // Done
     init_pair(2, COLOR_RED, COLOR_BLACK);     // Overdue
@@ -111,81 +1097,135 @@ void init_screen() {
     init_pair(4, COLOR_BLUE, COLOR_BLACK);    // Categories
 }
 
+// Only the rows inside the viewport are formatted. erase() keeps ncurses'
+// copy of the screen, so refresh() sends just the cells that changed: moving
+// the cursor repaints the old and new selected rows and nothing else.
 void draw_screen() {
-    clear();
+    PROFILE_BEGIN(frame);
+#ifdef TODO_PROFILE
+    long long scanned = atomic_load_explicit(&profile_scanned, memory_order_relaxed);
+#endif
+    erase();
 
-    // Header
-    attron(A_BOLD);
-    mvprintw(0, 0, "MINIMAL TODO TUI");
-    attroff(A_BOLD);
+    // The view first, as building it may bring todos back from the archive
+    refresh_view();
 
-    mvprintw(1, 0, "Filter: %s | Status: %s | Search: %s",
+    // Header
+    time_t now = time(NULL);
+    draw_counts(now);
+    mvprintw(1, 0, "Filter: %s | Status: %s | Due: %s | Search: %s | Sort: %s",
              filter_category[0] ? filter_category : "All",
              filter_done == -1 ? "All" : (filter_done == 0 ? "Pending" : "Done"),
-             search_term[0] ? search_term : "None");
+             filter_due == DUE_ALL ? "All" : (filter_due == DUE_OVERDUE ? "Overdue" : "Upcoming"),
+             search_term[0] ? search_term : "None",
+             sort_name(sort_mode));
+    if (filter_query[0]) printw(" | Query: %s", filter_query);
+    if (marked.count > 0) printw(" | Marked: %d", marked.count);
+
+    // Scroll so the selected todo stays inside the viewport, streaming in
+    // the view a screenful past it
+    int view_rows = LINES - 4;
+    if (view_rows < 1) view_rows = 1;
+    stream_view(selected + view_rows + 1);
+    if (selected >= view.count) selected = view.count - 1;
+    if (selected < 0) selected = 0;
+
+    if (selected < scroll_top) scroll_top = selected;
+    if (selected >= scroll_top + view_rows) scroll_top = selected - view_rows + 1;
+    if (scroll_top > 0 && scroll_top + view_rows > view.count) {
+        scroll_top = view.count > view_rows ? view.count - view_rows : 0;
+    }
 
     // Todos
-    int y = 3;
-    int visible_count = 0;
+    for (int pos = scroll_top; pos < view.count && pos < scroll_top + view_rows; pos++) {
+        draw_todo_row(3 + pos - scroll_top, pos, now);
+    }
+    rows_drawn_at = now;
 
-    for (int i = 0; i < todo_count; i++) {
-        if (todo_matches_filter(i)) {
-            // Highlight selected item
-            if (i == selected) attron(A_REVERSE);
-
-            // Done status
-            mvprintw(y, 0, "[%c] ", todos[i].done ? 'X' : ' ');
-
-            // Todo text with colors
-            if (todos[i].done) {
-                attron(COLOR_PAIR(1));
-                mvprintw(y, 4, "%s", todos[i].text);
-                attroff(COLOR_PAIR(1));
-            } else {
-                mvprintw(y, 4, "%s", todos[i].text);
-            }
+    if (view.count == 0) {
+        mvprintw(3, 0, "No matching todos found.");
+    }
+#ifdef TODO_PROFILE
+    profile_frame_scanned = atomic_load_explicit(&profile_scanned, memory_order_relaxed) - scanned;
+    profile_frame_drawn = view.count - scroll_top < view_rows ? view.count - scroll_top : view_rows;
+    if (profile_overlay) draw_profile();
+#endif
 
-            // Category
-            if (todos[i].category[0]) {
-                attron(COLOR_PAIR(4));
-                mvprintw(y, 4 + strlen(todos[i].text) + 1, "(%s)", todos[i].category);
-                attroff(COLOR_PAIR(4));
-            }
+    // Footer with commands
+    mvprintw(LINES - 1, 0,
+             "a:Add d:Delete Space:Toggle e:Edit D:Due R:Repeat c:Set-Cat C:Filter-Cat F:Query f:Filter-Status o:Filter-Due s:Sort v:Mark V:Mark-All P:Purge-Done u:Undo U:Redo /:Search r:Reset q:Quit");
 
-            // Due date
-            if (todos[i].due_date > 0) {
-                time_t now = time(NULL);
-                time_t day_seconds = 24 * 60 * 60;
+    refresh();
+    PROFILE_END(frame, SPAN_FRAME);
+}
 
-                if (todos[i].due_date < now) {
-                    attron(COLOR_PAIR(2)); // Overdue
-                } else if (todos[i].due_date < now + 2 * day_seconds) {
-                    attron(COLOR_PAIR(3)); // Due soon
-                }
+// The first header line: the counts, which move with the clock
+void draw_counts(time_t now) {
+    if (counters_ready) {
+        advance_overdue(now);
+    } else {
+        build_counters(now);
+    }
+    int live = todo_count - deleted_count;
+    move(0, 0);
+    clrtoeol();
+    attron(A_BOLD);
+    printw("MINIMAL TODO TUI");
+    attroff(A_BOLD);
+    printw("  %d todos | %d pending | %d done | %d overdue", live, live - done_total,
+           done_total, overdue_total);
+    if (archived_todos > 0) printw(" | %ld archived", archived_todos);
+}
 
-                char* date_str = format_date(todos[i].due_date);
-                mvprintw(y, COLS - strlen(date_str) - 1, "%s", date_str);
-                free(date_str);
+void draw_todo_row(int y, int pos, time_t now) {
+    int i = view.items[pos];
 
-                attroff(COLOR_PAIR(2));
-                attroff(COLOR_PAIR(3));
-            }
+    // Highlight selected item
+    if (pos == selected) attron(A_REVERSE);
 
-            if (i == selected) attroff(A_REVERSE);
-            y++;
-            visible_count++;
-        }
+    // Done status, with a star on marked todos
+    mvprintw(y, 0, "[%c]%c", todos[i].done ? 'X' : ' ', list_contains_sorted(&marked, i) ? '*' : ' ');
+
+    // Todo text with colors
+    if (todos[i].done) {
+        attron(COLOR_PAIR(1));
+        mvprintw(y, 4, "%s", todo_text(i));
+        attroff(COLOR_PAIR(1));
+    } else {
+        mvprintw(y, 4, "%s", todo_text(i));
     }
 
-    if (visible_count == 0) {
-        mvprintw(y, 0, "No matching todos found.");
+    // Category
+    if (todos[i].category_id != CATEGORY_NONE) {
+        attron(COLOR_PAIR(4));
+        mvprintw(y, 4 + todos[i].text_len + 1, "(%s)", todo_category(i));
+        attroff(COLOR_PAIR(4));
     }
 
-    // Footer with commands
-    mvprintw(LINES - 1, 0,
-             "a:Add d:Delete Space:Toggle e:Edit D:Due c:Set-Cat C:Filter-Cat f:Filter-Status /:Search r:Reset q:Quit");
+    // Due date
+    if (todos[i].due_date > 0) {
+        int colour = due_colour(i, now);
+        if (colour) attron(COLOR_PAIR(colour));
 
-    refresh();
+        char date_str[DATE_LENGTH];
+        format_date(todos[i].due_date, date_str);
+        mvprintw(y, COLS - DATE_LENGTH, "%s", date_str);
+
+        attroff(COLOR_PAIR(2));
+        attroff(COLOR_PAIR(3));
+    }
+
+    // Recurrence, left of the due date
+    uint32_t repeat = todo_repeat(i);
+    if (repeat) {
+        char repeat_str[REPEAT_LENGTH];
+        format_repeat(repeat, repeat_str);
+        attron(COLOR_PAIR(4));
+        mvprintw(y, COLS - DATE_LENGTH - REPEAT_LENGTH, "%*s", REPEAT_LENGTH - 1, repeat_str);
+        attroff(COLOR_PAIR(4));
+    }
+
+    if (pos == selected) attroff(A_REVERSE);
 }
 
 void add_todo() {
@@ -194,31 +1234,320 @@ void add_todo() {
     mvprintw(LINES - 2, 0, "New todo: ");
     clrtoeol();
 
-    char new_todo[MAX_LENGTH];
-    getstr(new_todo);
+    char text[MAX_LENGTH];
+    getnstr(text, MAX_LENGTH - 1);
 
-    if (new_todo[0] != '\0' && todo_count < MAX_TODOS) {
-        strncpy(todos[todo_count].text, new_todo, MAX_LENGTH - 1);
-        todos[todo_count].category[0] = '\0';
-        todos[todo_count].due_date = 0;
-        todos[todo_count].done = 0;
-        todo_count++;
-        selected = todo_count - 1;
+    if (text[0] != '\0') {
+        size_t len = strlen(text);
+        int idx = store_add(text, len, next_uid(), time(NULL));
+        journal_write(OP_ADD, idx, todos[idx].created_at, text, len);
+        history_batch(HISTORY_UNDO, OP_BATCH_DELETE, &idx, 1, 0, NULL, 0);
+        history_restore(HISTORY_REDO, &idx, 1);
+        history_commit();
+        int pos = view_find(idx);
+        if (pos >= 0) selected = pos;
     }
 
     noecho();
 }
 
-void delete_todo(int idx) {
-    for (int i = idx; i < todo_count - 1; i++) {
-        todos[i] = todos[i + 1];
+// The todos a command acts on: the marked ones if any, else the selected one
+int command_targets(int **slots) {
+    static int single;
+    if (marked.count > 0) {
+        *slots = marked.items;
+        return marked.count;
+    }
+    if (view.count == 0) return 0;
+    single = view.items[selected];
+    *slots = &single;
+    return 1;
+}
+
+void toggle_mark() {
+    int idx = view.items[selected];
+    if (list_contains_sorted(&marked, idx)) {
+        list_remove_sorted(&marked, idx);
+    } else {
+        list_insert_sorted(&marked, idx);
+    }
+    if (selected < view.count - 1) selected++;
+}
+
+// Marks every todo in the view, or clears the marks if there are any
+void mark_all() {
+    if (marked.count > 0) {
+        marked.count = 0;
+        return;
+    }
+    stream_view(INT32_MAX);
+    list_copy(&marked, &view);
+    qsort(marked.items, marked.count, sizeof(int), compare_index);
+}
+
+// A batch is applied as one store update and written as one journal record.
+// The marks are cleared once a command has used them.
+void delete_todos(const int *slots, int count) {
+    history_restore(HISTORY_UNDO, slots, count);
+    history_batch(HISTORY_REDO, OP_BATCH_DELETE, slots, count, 0, NULL, 0);
+    history_commit();
+    if (count == 1) {
+        store_delete(slots[0]);
+        journal_write(OP_DELETE, slots[0], 0, NULL, 0);
+    } else {
+        store_batch(OP_BATCH_DELETE, slots, count, 0, NULL, 0);
+        journal_write_batch(OP_BATCH_DELETE, slots, count, 0, NULL, 0);
+    }
+    marked.count = 0;
+}
+
+// The archive holds only done todos, so all of it is purged too. It is
+// thawed first so that undo can bring the purged todos back.
+void purge_done() {
+    static IndexList purged;
+    thaw_archive(NULL, 0);
+    purged.count = 0;
+    for (int i = 0; i < todo_count; i++) {
+        if (todos[i].done && !(todos[i].flags & TODO_DELETED)) list_push(&purged, i);
+    }
+    history_restore(HISTORY_UNDO, purged.items, purged.count);
+    history_batch(HISTORY_REDO, OP_BATCH_DELETE, purged.items, purged.count, 0, NULL, 0);
+    history_commit();
+
+    store_purge_done();
+    journal_append(OP_PURGE_DONE, 0, 0, NULL, 0);
+}
+
+// A batch becomes done unless all of it already is. Completing a series
+// moves it on to its next occurrence instead, which is the only one ever
+// stored.
+void toggle_todos(const int *slots, int count) {
+    static IndexList changed, series;
+    int done = 0;
+    for (int n = 0; n < count && !done; n++) done = !todos[slots[n]].done;
+    changed.count = series.count = 0;
+    for (int n = 0; n < count; n++) {
+        if (done && todo_repeat(slots[n])) {
+            list_push(&series, slots[n]);
+        } else if (todos[slots[n]].done != done) {
+            list_push(&changed, slots[n]);
+        }
+    }
+    history_batch(HISTORY_UNDO, OP_BATCH_DONE, changed.items, changed.count, !done, NULL, 0);
+    history_batch(HISTORY_REDO, OP_BATCH_DONE, changed.items, changed.count, done, NULL, 0);
+    history_grouped(OP_BATCH_DUE, series.items, series.count);
+
+    if (changed.count == 1) {
+        store_set_done(changed.items[0], done);
+        journal_write(OP_DONE, changed.items[0], done, NULL, 0);
+    } else if (changed.count > 1) {
+        store_batch(OP_BATCH_DONE, changed.items, changed.count, done, NULL, 0);
+        journal_write_batch(OP_BATCH_DONE, changed.items, changed.count, done, NULL, 0);
+    }
+    time_t now = time(NULL);
+    for (int n = 0; n < series.count; n++) {
+        int idx = series.items[n];
+        time_t next = next_occurrence(todos[idx].due_date, todo_repeat(idx), now);
+        history_record(HISTORY_REDO, OP_DUE, todos[idx].uid, next, NULL, 0);
+        store_set_due_date(idx, next);
+        journal_write(OP_DUE, idx, next, NULL, 0);
+    }
+    history_commit();
+    marked.count = 0;
+}
+
+// Queues a record for the step of the running command
+void history_record(int side, int op, uint64_t uid, int64_t value, const char *data, size_t len) {
+    HistoryBuffer *buffer = &history_pending[side];
+    if (buffer->size + sizeof(JournalRecord) + len > buffer->capacity) {
+        buffer->capacity = (buffer->size + sizeof(JournalRecord) + len) * 2;
+        buffer->data = xrealloc(buffer->data, buffer->capacity);
+    }
+
+    JournalRecord rec = {0};
+    rec.length = len;
+    rec.value = value;
+    rec.uid = uid;
+    rec.op = op;
+    memcpy(buffer->data + buffer->size, &rec, sizeof(JournalRecord));
+    if (len) memcpy(buffer->data + buffer->size + sizeof(JournalRecord), data, len);
+    buffer->size += sizeof(JournalRecord) + len;
+}
+
+// Queues a batch record in the journal's layout: the uids, then name
+void history_batch(int side, int op, const int *slots, int count, int64_t value,
+                   const char *name, size_t len) {
+    static char *payload = NULL;
+    static size_t capacity = 0;
+    if (count == 0) return;
+
+    size_t size = count * sizeof(uint64_t) + len;
+    if (size > capacity) {
+        capacity = size;
+        payload = xrealloc(payload, capacity);
+    }
+    for (int n = 0; n < count; n++) {
+        memcpy(payload + n * sizeof(uint64_t), &todos[slots[n]].uid, sizeof(uint64_t));
+    }
+    if (len) memcpy(payload + count * sizeof(uint64_t), name, len);
+    history_record(side, op, count, value, payload, size);
+}
+
+// Queues a record that brings the todos back as they are now
+void history_restore(int side, const int *slots, int count) {
+    static char *payload = NULL;
+    static size_t capacity = 0;
+    if (count == 0) return;
+
+    size_t size = pack_todos(slots, count, &payload, &capacity);
+    history_record(side, OP_BATCH_RESTORE, count, 0, payload, size);
+}
+
+// Writes the todos in the layout of a restore record's payload into
+// *payload, growing it as needed; returns the size
+size_t pack_todos(const int *slots, int count, char **payload, size_t *capacity) {
+    size_t size = 0;
+    for (int n = 0; n < count; n++) {
+        const Todo *todo = &todos[slots[n]];
+        size += sizeof(RestoreEntry) + todo->text_len + categories[todo->category_id].name_len;
+    }
+    if (size > *capacity) {
+        *capacity = size;
+        *payload = xrealloc(*payload, *capacity);
+    }
+
+    size_t pos = 0;
+    for (int n = 0; n < count; n++) {
+        const Todo *todo = &todos[slots[n]];
+        RestoreEntry entry = {0};
+        entry.uid = todo->uid;
+        entry.created_at = todo->created_at;
+        entry.due_date = todo->due_date;
+        entry.text_len = todo->text_len;
+        entry.category_len = categories[todo->category_id].name_len;
+        entry.repeat = todo_repeat(slots[n]);
+        entry.done = todo->done != 0;
+        memcpy(*payload + pos, &entry, sizeof(RestoreEntry));
+        pos += sizeof(RestoreEntry);
+        memcpy(*payload + pos, todo_text(slots[n]), entry.text_len);
+        pos += entry.text_len;
+        memcpy(*payload + pos, todo_category(slots[n]), entry.category_len);
+        pos += entry.category_len;
+    }
+    return size;
+}
+
+// Queues the undo of setting the due date, category or recurrence of the
+// todos: one batch record per distinct old value
+void history_grouped(int op, const int *slots, int count) {
+    static HistoryGroup *groups = NULL;
+    static int *run = NULL;
+    static int capacity = 0;
+    if (count > capacity) {
+        capacity = count;
+        groups = xrealloc(groups, capacity * sizeof(HistoryGroup));
+        run = xrealloc(run, capacity * sizeof(int));
+    }
+
+    for (int n = 0; n < count; n++) {
+        const Todo *todo = &todos[slots[n]];
+        groups[n].key = op == OP_BATCH_DUE      ? todo->due_date
+                      : op == OP_BATCH_CATEGORY ? todo->category_id
+                      : todo_repeat(slots[n]);
+        groups[n].idx = slots[n];
+    }
+    qsort(groups, count, sizeof(HistoryGroup), compare_history_group);
+
+    for (int first = 0, last; first < count; first = last) {
+        for (last = first; last < count && groups[last].key == groups[first].key; last++) {
+            run[last - first] = groups[last].idx;
+        }
+        if (op != OP_BATCH_CATEGORY) {
+            history_batch(HISTORY_UNDO, op, run, last - first, groups[first].key, NULL, 0);
+        } else {
+            int id = groups[first].key;
+            history_batch(HISTORY_UNDO, op, run, last - first, 0, category_name(id),
+                          categories[id].name_len);
+        }
+    }
+}
+
+int compare_history_group(const void *a, const void *b) {
+    const HistoryGroup *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->idx - y->idx;
+}
+
+// Ends the running command's step, dropping the steps it can no longer
+// redo and then the oldest ones until the history fits its budget. A step
+// larger than the whole budget clears the history instead.
+void history_commit() {
+    HistoryBuffer *undo_records = &history_pending[HISTORY_UNDO];
+    HistoryBuffer *redo_records = &history_pending[HISTORY_REDO];
+    size_t size = undo_records->size + redo_records->size;
+
+    while (history_count > history_pos) {
+        HistoryStep *step = &history[--history_count];
+        history_bytes -= step->undo_size + step->redo_size;
+        free(step->data);
+    }
+    if (size > 0 && size <= HISTORY_BUDGET) {
+        if (history_count == history_capacity) {
+            history_capacity = history_capacity ? history_capacity * 2 : 64;
+            history = xrealloc(history, history_capacity * sizeof(HistoryStep));
+        }
+        HistoryStep *step = &history[history_count++];
+        step->data = xrealloc(NULL, size);
+        memcpy(step->data, undo_records->data, undo_records->size);
+        memcpy(step->data + undo_records->size, redo_records->data, redo_records->size);
+        step->undo_size = undo_records->size;
+        step->redo_size = redo_records->size;
+        history_bytes += size;
+    }
+
+    int dropped = 0;
+    while (dropped < history_count && (history_bytes > HISTORY_BUDGET || size > HISTORY_BUDGET)) {
+        history_bytes -= history[dropped].undo_size + history[dropped].redo_size;
+        free(history[dropped].data);
+        dropped++;
+    }
+    memmove(history, history + dropped, (history_count - dropped) * sizeof(HistoryStep));
+    history_count -= dropped;
+    history_pos = history_count;
+    undo_records->size = redo_records->size = 0;
+}
+
+// Replays a step's records and journals them, as if the user had made the
+// changes; todos another instance has deleted since are skipped
+void apply_history(const char *records, size_t size) {
+    const char *end = records + size;
+    while (records < end) {
+        JournalRecord rec;
+        memcpy(&rec, records, sizeof(JournalRecord));
+        const char *payload = records + sizeof(JournalRecord);
+        replay_record(&rec, payload);
+        journal_append(rec.op, rec.uid, rec.value, payload, rec.length);
+        records = payload + rec.length;
+    }
+    marked.count = 0;
+}
+
+void undo() {
+    if (history_pos == 0) {
+        beep();
+        return;
     }
-    todo_count--;
-    if (selected >= todo_count && selected > 0) selected--;
+    HistoryStep *step = &history[--history_pos];
+    apply_history(step->data, step->undo_size);
 }
 
-void toggle_todo(int idx) {
-    todos[idx].done = !todos[idx].done;
+void redo() {
+    if (history_pos == history_count) {
+        beep();
+        return;
+    }
+    HistoryStep *step = &history[history_pos++];
+    apply_history(step->data + step->undo_size, step->redo_size);
 }
 
 void edit_todo(int idx) {
@@ -228,124 +1557,5257 @@ void edit_todo(int idx) {
     clrtoeol();
 
     char edit[MAX_LENGTH];
-    getstr(edit);
+    getnstr(edit, MAX_LENGTH - 1);
 
     if (edit[0] != '\0') {
-        strncpy(todos[idx].text, edit, MAX_LENGTH - 1);
+        size_t len = strlen(edit);
+        history_record(HISTORY_UNDO, OP_TEXT, todos[idx].uid, 0, todo_text(idx), todos[idx].text_len);
+        history_record(HISTORY_REDO, OP_TEXT, todos[idx].uid, 0, edit, len);
+        history_commit();
+        store_set_text(idx, edit, len);
+        journal_write(OP_TEXT, idx, 0, edit, len);
+        int pos = view_find(idx); // Sorted by text, the todo may have moved
+        if (pos >= 0) selected = pos;
     }
 
     noecho();
 }
 
-void set_due_date(int idx) {
+void set_due_date(const int *slots, int count) {
     echo();
 
     mvprintw(LINES - 2, 0, "Due date (YYYY-MM-DD or blank to clear): ");
     clrtoeol();
 
     char date_str[MAX_LENGTH];
-    getstr(date_str);
+    getnstr(date_str, MAX_LENGTH - 1);
 
-    if (date_str[0] == '\0') {
-        todos[idx].due_date = 0;
-    } else {
-        struct tm tm_date = {0};
-        if (sscanf(date_str, "%d-%d-%d", &tm_date.tm_year, &tm_date.tm_mon, &tm_date.tm_mday) == 3) {
-            tm_date.tm_year -= 1900; // Years since 1900
-            tm_date.tm_mon -= 1;     // Months are 0-11
-            todos[idx].due_date = mktime(&tm_date);
-        }
+    time_t due_date;
+    int valid = parse_date(date_str, &due_date);
+
+    if (valid) {
+        history_grouped(OP_BATCH_DUE, slots, count);
+        history_batch(HISTORY_REDO, OP_BATCH_DUE, slots, count, due_date, NULL, 0);
+        history_commit();
+    }
+    if (valid && count == 1) {
+        store_set_due_date(slots[0], due_date);
+        journal_write(OP_DUE, slots[0], due_date, NULL, 0);
+    } else if (valid) {
+        store_batch(OP_BATCH_DUE, slots, count, due_date, NULL, 0);
+        journal_write_batch(OP_BATCH_DUE, slots, count, due_date, NULL, 0);
     }
+    if (valid) marked.count = 0;
 
     noecho();
 }
 
-void set_category(int idx) {
+void set_category(const int *slots, int count) {
     echo();
 
     mvprintw(LINES - 2, 0, "Category: ");
     clrtoeol();
 
     char category[MAX_LENGTH];
-    getstr(category);
+    getnstr(category, MAX_LENGTH - 1);
 
-    strncpy(todos[idx].category, category, MAX_LENGTH - 1);
+    size_t len = strlen(category);
+    history_grouped(OP_BATCH_CATEGORY, slots, count);
+    history_batch(HISTORY_REDO, OP_BATCH_CATEGORY, slots, count, 0, category, len);
+    history_commit();
+    if (count == 1) {
+        store_set_category(slots[0], category, len);
+        journal_write(OP_CATEGORY, slots[0], 0, category, len);
+    } else {
+        store_batch(OP_BATCH_CATEGORY, slots, count, 0, category, len);
+        journal_write_batch(OP_BATCH_CATEGORY, slots, count, 0, category, len);
+    }
+    marked.count = 0;
 
     noecho();
 }
 
-void filter_by_category() {
+// A series needs a first occurrence, so undated todos given a rule start
+// today
+void set_repeat(const int *slots, int count) {
+    static IndexList undated;
     echo();
 
-    mvprintw(LINES - 2, 0, "Filter by category (blank for all): ");
+    mvprintw(LINES - 2, 0, "Repeat (daily, weekly, monthly, Nd, Nw, Nm or blank to stop): ");
     clrtoeol();
 
-    getstr(filter_category);
-    selected = 0;
-
-    noecho();
-}
-
-void filter_by_status() {
-    filter_done = (filter_done + 1) % 3 - 1; // Cycle through -1, 0, 1
-    selected = 0;
-}
-
-void search_todos() {
-    echo();
+    char repeat_str[MAX_LENGTH];
+    getnstr(repeat_str, MAX_LENGTH - 1);
 
-    mvprintw(LINES - 2, 0, "Search: ");
-    clrtoeol();
+    uint32_t repeat;
+    if (parse_repeat(repeat_str, &repeat)) {
+        undated.count = 0;
+        for (int n = 0; n < count && repeat; n++) {
+            if (todos[slots[n]].due_date <= 0) list_push(&undated, slots[n]);
+        }
+        time_t today = start_of_day(time(NULL));
+        history_grouped(OP_BATCH_REPEAT, slots, count);
+        history_batch(HISTORY_UNDO, OP_BATCH_DUE, undated.items, undated.count, 0, NULL, 0);
+        history_batch(HISTORY_REDO, OP_BATCH_DUE, undated.items, undated.count, today, NULL, 0);
+        history_batch(HISTORY_REDO, OP_BATCH_REPEAT, slots, count, repeat, NULL, 0);
+        history_commit();
 
-    getstr(search_term);
-    selected = 0;
+        // The due dates first, so monthly rules can take their day of the month
+        if (undated.count == 1) {
+            store_set_due_date(undated.items[0], today);
+            journal_write(OP_DUE, undated.items[0], today, NULL, 0);
+        } else if (undated.count > 1) {
+            store_batch(OP_BATCH_DUE, undated.items, undated.count, today, NULL, 0);
+            journal_write_batch(OP_BATCH_DUE, undated.items, undated.count, today, NULL, 0);
+        }
+        if (count == 1) {
+            store_set_repeat(slots[0], repeat);
+            journal_write(OP_REPEAT, slots[0], repeat, NULL, 0);
+        } else {
+            store_batch(OP_BATCH_REPEAT, slots, count, repeat, NULL, 0);
+            journal_write_batch(OP_BATCH_REPEAT, slots, count, repeat, NULL, 0);
+        }
+        marked.count = 0;
+    }
 
     noecho();
 }
 
-int todo_matches_filter(int idx) {
-    // Status filter
-    if (filter_done != -1 && todos[idx].done != filter_done) {
-        return 0;
+// Picks the category filter from the categories in use, with their counts
+// from the header counters. The first row clears the filter.
+void filter_by_category() {
+    static int *choices = NULL;
+    static int capacity = 0;
+    if (category_count + 1 > capacity) {
+        capacity = category_count + 1;
+        choices = xrealloc(choices, capacity * sizeof(int));
     }
 
-    // Category filter
-    if (filter_category[0] &&
-        strcasecmp(todos[idx].category, filter_category) != 0) {
-        return 0;
+    draw_screen(); // Brings the counters up to date
+    int count = 0;
+    choices[count++] = CATEGORY_NONE;
+    for (int id = CATEGORY_NONE + 1; id < category_count && id < category_counts_capacity; id++) {
+        if (category_counts[id].total > 0) choices[count++] = id;
     }
+    qsort(choices + 1, count - 1, sizeof(int), compare_category_keys);
 
-    // Search filter
-    if (search_term[0] &&
-        strcasestr(todos[idx].text, search_term) == NULL &&
-        strcasestr(todos[idx].category, search_term) == NULL) {
-        return 0;
+    int current = filter_category[0] ? find_category(filter_category) : CATEGORY_NONE;
+    int choice = 0;
+    for (int n = 0; n < count; n++) {
+        if (choices[n] == current) choice = n;
     }
 
-    return 1;
+    int top = 0;
+    while (1) {
+        int rows = LINES - 6;
+        if (rows < 1) rows = 1;
+        if (choice < top) top = choice;
+        if (choice >= top + rows) top = choice - rows + 1;
+
+        draw_screen();
+        for (int y = 3; y < LINES - 1; y++) {
+            move(y, 0);
+            clrtoeol();
+        }
+        attron(A_BOLD);
+        mvprintw(3, 0, "%-40s %10s %10s", "Category", "Todos", "Pending");
+        attroff(A_BOLD);
+        for (int n = top; n < count && n < top + rows; n++) {
+            int id = choices[n];
+            int total = id == CATEGORY_NONE ? todo_count - deleted_count : category_counts[id].total;
+            int done = id == CATEGORY_NONE ? done_total : category_counts[id].done;
+            if (n == choice) attron(A_REVERSE);
+            mvprintw(4 + n - top, 0, "%-40.40s %10d %10d", id == CATEGORY_NONE ? "(all)" : category_name(id),
+                     total, total - done);
+            if (n == choice) attroff(A_REVERSE);
+        }
+        mvprintw(LINES - 2, 0, "Filter by category: j/k to move, Enter to pick, Esc to cancel");
+        refresh();
+
+        int ch = getch();
+        if (ch == 'j' || ch == KEY_DOWN) {
+            if (choice < count - 1) choice++;
+        } else if (ch == 'k' || ch == KEY_UP) {
+            if (choice > 0) choice--;
+        } else if (ch == '\n' || ch == KEY_ENTER) {
+            break;
+        } else if (ch == 27 || ch == 'q') { // Escape
+            return;
+        }
+    }
+
+    int id = choices[choice];
+    snprintf(filter_category, MAX_LENGTH, "%s", id == CATEGORY_NONE ? "" : category_name(id));
+    invalidate_view();
+    selected = 0;
 }
 
-char* format_date(time_t date) {
-    struct tm *tm_info = localtime(&date);
-    char *buffer = malloc(20);
-    strftime(buffer, 20, "%Y-%m-%d", tm_info);
-    return buffer;
+// Orders category ids by case-folded name
+int compare_category_keys(const void *a, const void *b) {
+    const Category *x = &categories[*(const int *)a], *y = &categories[*(const int *)b];
+    return strcmp(string_pool + x->key_off, string_pool + y->key_off);
 }
 
-void save_todos() {
-    FILE *file = fopen(DATA_FILE, "wb");
-    if (file) {
-        fwrite(&todo_count, sizeof(int), 1, file);
-        fwrite(todos, sizeof(Todo), todo_count, file);
-        fclose(file);
+// Filters by an expression on top of the quick filters; a malformed one
+// leaves the previous expression in place
+void filter_by_query() {
+    echo();
+
+    mvprintw(LINES - 2, 0, "Query: ");
+    clrtoeol();
+
+    char text[MAX_LENGTH];
+    getnstr(text, MAX_LENGTH - 1);
+
+    const char *error;
+    if (compile_query(text, &filter_terms, &error)) {
+        strcpy(filter_query, text);
+        invalidate_view();
+        selected = 0;
+    } else {
+        compile_query(filter_query, &filter_terms, &error);
     }
+
+    noecho();
 }
 
-void load_todos() {
-    FILE *file = fopen(DATA_FILE, "rb");
-    if (file) {
-        fread(&todo_count, sizeof(int), 1, file);
-        fread(todos, sizeof(Todo), todo_count, file);
+void filter_by_status() {
+    filter_done = (filter_done + 2) % 3 - 1; // Cycle through -1, 0, 1
+    invalidate_view();
+    selected = 0;
+}
+
+void filter_by_due() {
+    filter_due = (filter_due + 1) % 3; // Cycle through all, overdue, upcoming
+    invalidate_view();
+    selected = 0;
+}
+
+void toggle_sort() {
+    sort_mode = (sort_mode + 1) % SORT_MODES; // Cycle through every sort
+    invalidate_view();
+    selected = 0;
+}
+
+// Filters live as the term is typed. search_levels[n] holds the matches for
+// the first n characters: a new character only narrows the previous level,
+// and Backspace steps back to the cached level below. Enter keeps the term,
+// Escape restores the one that was active before. A term that thaws
+// archived todos leaves the levels below it without them, so those are
+// rebuilt from a fresh view when Backspace reaches them.
+void search_todos() {
+    static IndexList search_levels[MAX_LENGTH];
+    static IndexList candidates;
+    char previous_term[MAX_LENGTH];
+    char folded[MAX_LENGTH];
+    strcpy(previous_term, search_term);
+
+    int len = 0;
+    int fresh = 0; // Levels from here up include every thawed todo
+    search_term[0] = '\0';
+    full_view(&search_levels[0]);
+
+    while (1) {
+        selected = 0;
+        draw_screen();
+        mvprintw(LINES - 2, 0, "Search: %s", search_term);
+        clrtoeol();
+        refresh();
+
+        int ch = getch();
+        if (ch == '\n' || ch == KEY_ENTER) {
+            break;
+        } else if (ch == 27) { // Escape
+            strcpy(search_term, previous_term);
+            invalidate_view();
+            break;
+        } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+            if (len == 0) continue;
+            search_term[--len] = '\0';
+            if (len < fresh) {
+                full_view(&search_levels[len]);
+                fresh = len;
+            }
+        } else if (isprint(ch) && len < MAX_LENGTH - 1) {
+            search_term[len++] = ch;
+            search_term[len] = '\0';
+
+            // Narrow whichever is smaller: the previous level, or the
+            // index candidates (which still need every other term, even
+            // those the plan's own index stands in for)
+            PROFILE_BEGIN(search);
+            IndexList *from = &search_levels[len - 1];
+            IndexList *to = &search_levels[len];
+            to->count = 0;
+            long archived = archived_todos;
+            plan_view();
+            if (archived_todos != archived) {
+                full_view(to);
+                fresh = len;
+            } else if (trigram_candidates(search_term, &candidates) && candidates.count < from->count) {
+                for (int i = 0; i < candidates.count; i++) {
+                    if (todo_matches_plan(candidates.items[i])) list_push(to, candidates.items[i]);
+                }
+                if (sort_mode != SORT_NONE) sort_indices(to);
+            } else {
+                fold_ascii(folded, search_term);
+                for (int i = 0; i < from->count; i++) {
+                    if (todo_contains(from->items[i], folded, len)) list_push(to, from->items[i]);
+                }
+                PROFILE_COUNT(profile_scanned, from->count);
+            }
+            PROFILE_END(search, SPAN_SEARCH);
+        } else {
+            continue;
+        }
+        list_copy(&view, &search_levels[len]);
+        view_streaming = 0;
+    }
+
+    selected = 0;
+}
+
+// Builds the whole view for the current filters into level
+void full_view(IndexList *level) {
+    invalidate_view();
+    refresh_view();
+    stream_view(INT32_MAX);
+    list_copy(level, &view);
+}
+
+void list_push(IndexList *list, int value) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : INITIAL_TODO_CAPACITY;
+        list->items = xrealloc(list->items, list->capacity * sizeof(int));
+    }
+    list->items[list->count++] = value;
+}
+
+void list_insert_sorted(IndexList *list, int value) {
+    if (list->count == 0 || list->items[list->count - 1] < value) {
+        list_push(list, value);
+        return;
+    }
+
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (list->items[mid] < value) lo = mid + 1; else hi = mid;
+    }
+    if (list->items[lo] == value) return;
+
+    list_push(list, 0);
+    memmove(&list->items[lo + 1], &list->items[lo], (list->count - lo - 1) * sizeof(int));
+    list->items[lo] = value;
+}
+
+void list_remove_sorted(IndexList *list, int value) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (list->items[mid] < value) lo = mid + 1; else hi = mid;
+    }
+    if (lo == list->count || list->items[lo] != value) return;
+
+    memmove(&list->items[lo], &list->items[lo + 1], (list->count - lo - 1) * sizeof(int));
+    list->count--;
+}
+
+int list_contains_sorted(const IndexList *list, int value) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (list->items[mid] < value) lo = mid + 1; else hi = mid;
+    }
+    return lo < list->count && list->items[lo] == value;
+}
+
+void list_append(IndexList *dst, const IndexList *src) {
+    if (dst->capacity < dst->count + src->count) {
+        dst->capacity = dst->count + src->count;
+        dst->items = xrealloc(dst->items, dst->capacity * sizeof(int));
+    }
+    memcpy(dst->items + dst->count, src->items, src->count * sizeof(int));
+    dst->count += src->count;
+}
+
+void list_copy(IndexList *dst, const IndexList *src) {
+    if (dst->capacity < src->count) {
+        dst->capacity = src->count;
+        dst->items = xrealloc(dst->items, dst->capacity * sizeof(int));
+    }
+    memcpy(dst->items, src->items, src->count * sizeof(int));
+    dst->count = src->count;
+}
+
+uint32_t make_trigram(const char *str) {
+    return (uint32_t)tolower((unsigned char)str[0]) << 16 |
+           (uint32_t)tolower((unsigned char)str[1]) << 8 |
+           (uint32_t)tolower((unsigned char)str[2]);
+}
+
+// Finds the posting list of trigram, adding an empty one if create is set
+IndexList* trigram_postings(TrigramTable *table, uint32_t trigram, int create) {
+    if (!table->entries) {
+        if (!create) return NULL;
+        grow_trigram_table(table);
+    }
+
+    uint32_t slot = (trigram * 2654435761u) & (table->buckets - 1);
+    while (table->entries[slot].trigram != 0) {
+        if (table->entries[slot].trigram == trigram) return &table->entries[slot].todos;
+        slot = (slot + 1) & (table->buckets - 1);
+    }
+    if (!create) return NULL;
+
+    if ((table->count + 1) * 2 > table->buckets) {
+        grow_trigram_table(table);
+        return trigram_postings(table, trigram, create);
+    }
+    table->entries[slot].trigram = trigram;
+    table->count++;
+    return &table->entries[slot].todos;
+}
+
+void grow_trigram_table(TrigramTable *table) {
+    TrigramEntry *old_entries = table->entries;
+    int old_buckets = table->buckets;
+
+    table->buckets = old_buckets ? old_buckets * 2 : INITIAL_TRIGRAM_BUCKETS;
+    table->entries = xrealloc(NULL, table->buckets * sizeof(TrigramEntry));
+    memset(table->entries, 0, table->buckets * sizeof(TrigramEntry));
+
+    for (int i = 0; i < old_buckets; i++) {
+        if (old_entries[i].trigram == 0) continue;
+        uint32_t slot = (old_entries[i].trigram * 2654435761u) & (table->buckets - 1);
+        while (table->entries[slot].trigram != 0) slot = (slot + 1) & (table->buckets - 1);
+        table->entries[slot] = old_entries[i];
+    }
+    free(old_entries);
+}
+
+// Adds idx to (or removes it from) the postings of every trigram in str
+void index_string(TrigramTable *table, const char *str, size_t len, int idx, int add) {
+    for (size_t i = 0; i + TRIGRAM_LEN <= len; i++) {
+        IndexList *postings = trigram_postings(table, make_trigram(str + i), add);
+        if (add) {
+            list_insert_sorted(postings, idx);
+        } else if (postings) {
+            list_remove_sorted(postings, idx);
+        }
+    }
+}
+
+void build_trigram_index() {
+    build_indexes(INDEX_TRIGRAM);
+    trigram_ready = 1;
+}
+
+// Empties the posting lists, keeping their memory, until the next search
+// rebuilds them
+void drop_trigram_index() {
+    finish_index_build();
+    for (int b = 0; b < trigrams.buckets; b++) trigrams.entries[b].todos.count = 0;
+    trigram_ready = 0;
+}
+
+// A todo is indexed under the trigrams of both its text and its category
+void index_todo_trigrams(TrigramTable *table, int idx, int add) {
+    index_string(table, todo_text(idx), todos[idx].text_len, idx, add);
+    index_string(table, todo_category(idx), categories[todos[idx].category_id].name_len, idx, add);
+}
+
+// Must be called after the todo's strings are set, and unindex_todo() before
+// they change, so the old trigrams can still be read.
+void index_todo(int idx) {
+    if (trigram_ready) index_todo_trigrams(&trigrams, idx, 1);
+}
+
+void unindex_todo(int idx) {
+    if (trigram_ready) index_todo_trigrams(&trigrams, idx, 0);
+}
+
+// Builds the indexes in which from scratch, splitting the slots into one
+// contiguous range per core. Each worker indexes its range into private
+// tables; since the ranges are in slot order, merging is an append of
+// every partial posting list and a k-way merge of the sorted due entries.
+// The caller marks the indexes ready. Only reads the store, so the UI may
+// keep drawing while this runs on the index thread.
+void build_indexes(int which) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = todo_count / INDEX_MIN_PARTITION;
+    if (count > cores) count = cores;
+    if (count > INDEX_MAX_WORKERS) count = INDEX_MAX_WORKERS;
+    if (count < 1) count = 1;
+
+    IndexPartition parts[INDEX_MAX_WORKERS];
+    pthread_t threads[INDEX_MAX_WORKERS];
+    int started[INDEX_MAX_WORKERS] = {0};
+    memset(parts, 0, sizeof(parts));
+    for (int p = 0; p < count; p++) {
+        parts[p].first = (int)((int64_t)todo_count * p / count);
+        parts[p].last = (int)((int64_t)todo_count * (p + 1) / count);
+        parts[p].which = which;
+    }
+
+    // The calling thread takes the first range itself
+    for (int p = 1; p < count; p++) {
+        started[p] = pthread_create(&threads[p], NULL, build_partition, &parts[p]) == 0;
+    }
+    build_partition(&parts[0]);
+    for (int p = 1; p < count; p++) {
+        if (started[p]) {
+            pthread_join(threads[p], NULL);
+        } else {
+            build_partition(&parts[p]);
+        }
+    }
+
+    if (which & INDEX_TRIGRAM) merge_trigrams(parts, count);
+    if (which & INDEX_DUE) merge_due(parts, count);
+}
+
+void* build_partition(void *arg) {
+    IndexPartition *part = arg;
+    int capacity = 0;
+    for (int i = part->first; i < part->last; i++) {
+        if (todos[i].flags & TODO_DELETED) continue;
+        if (part->which & INDEX_TRIGRAM) index_todo_trigrams(&part->trigrams, i, 1);
+        if ((part->which & INDEX_DUE) && todos[i].due_date > 0) {
+            if (part->due_count == capacity) {
+                capacity = capacity ? capacity * 2 : INITIAL_TODO_CAPACITY;
+                part->due = xrealloc(part->due, capacity * sizeof(DueEntry));
+            }
+            part->due[part->due_count].due_date = todos[i].due_date;
+            part->due[part->due_count].idx = i;
+            part->due_count++;
+        }
+    }
+    if (part->which & INDEX_DUE) qsort(part->due, part->due_count, sizeof(DueEntry), compare_due_entry);
+    return NULL;
+}
+
+void merge_trigrams(IndexPartition *parts, int count) {
+    for (int b = 0; b < trigrams.buckets; b++) trigrams.entries[b].todos.count = 0;
+    for (int p = 0; p < count; p++) {
+        TrigramTable *table = &parts[p].trigrams;
+        for (int b = 0; b < table->buckets; b++) {
+            if (table->entries[b].trigram == 0) continue;
+            list_append(trigram_postings(&trigrams, table->entries[b].trigram, 1), &table->entries[b].todos);
+            free(table->entries[b].todos.items);
+        }
+        free(table->entries);
+    }
+}
+
+void merge_due(IndexPartition *parts, int count) {
+    int total = 0;
+    for (int p = 0; p < count; p++) total += parts[p].due_count;
+    if (total > due_capacity) {
+        due_capacity = total;
+        due_index = xrealloc(due_index, due_capacity * sizeof(DueEntry));
+    }
+
+    int next[INDEX_MAX_WORKERS] = {0};
+    for (due_count = 0; due_count < total; due_count++) {
+        int best = -1;
+        for (int p = 0; p < count; p++) {
+            if (next[p] == parts[p].due_count) continue;
+            if (best < 0 || compare_due_entry(&parts[p].due[next[p]], &parts[best].due[next[best]]) < 0) {
+                best = p;
+            }
+        }
+        due_index[due_count] = parts[best].due[next[best]++];
+    }
+    for (int p = 0; p < count; p++) free(parts[p].due);
+}
+
+void* index_thread_main(void *arg) {
+    (void)arg;
+    build_indexes(INDEX_TRIGRAM | INDEX_DUE);
+    atomic_store(&index_thread_done, 1);
+    return NULL;
+}
+
+// Large stores build their indexes on a thread of their own so the UI is
+// usable as soon as the records are mapped. Until the build finishes,
+// views and searches fall back to scanning, and any change to the store
+// first waits for it.
+void start_index_build() {
+    if (todo_count < INDEX_MIN_PARTITION || trigram_ready || due_ready) return;
+    atomic_store(&index_thread_done, 0);
+    if (pthread_create(&index_thread, NULL, index_thread_main, NULL) == 0) index_thread_running = 1;
+}
+
+// Whether the index thread is still building; adopts its indexes once done
+int index_build_pending() {
+    if (!index_thread_running) return 0;
+    if (!atomic_load(&index_thread_done)) return 1;
+    finish_index_build();
+    return 0;
+}
+
+void finish_index_build() {
+    if (!index_thread_running) return;
+    pthread_join(index_thread, NULL);
+    index_thread_running = 0;
+    trigram_ready = 1;
+    due_ready = 1;
+}
+
+// Fills out with the sorted todos containing every trigram of term. These
+// are candidates only: the caller still verifies them with the substring
+// check. Returns 0 if term is too short to use the index.
+int trigram_candidates(const char *term, IndexList *out) {
+    size_t len = strlen(term);
+    out->count = 0;
+    if (len < TRIGRAM_LEN || index_build_pending()) return 0;
+    if (!trigram_ready) build_trigram_index();
+
+    // Drive the intersection from the shortest posting list
+    IndexList *shortest = NULL;
+    for (size_t i = 0; i + TRIGRAM_LEN <= len; i++) {
+        IndexList *postings = trigram_postings(&trigrams, make_trigram(term + i), 0);
+        if (!postings || postings->count == 0) return 1;
+        if (!shortest || postings->count < shortest->count) shortest = postings;
+    }
+
+    for (int n = 0; n < shortest->count; n++) {
+        int idx = shortest->items[n];
+        int found = 1;
+        for (size_t i = 0; found && i + TRIGRAM_LEN <= len; i++) {
+            IndexList *postings = trigram_postings(&trigrams, make_trigram(term + i), 0);
+            if (postings != shortest) found = list_contains_sorted(postings, idx);
+        }
+        if (found) list_push(out, idx);
+    }
+    return 1;
+}
+
+void build_due_index() {
+    build_indexes(INDEX_DUE);
+    due_ready = 1;
+}
+
+int compare_due_entry(const void *a, const void *b) {
+    const DueEntry *x = a, *y = b;
+    if (x->due_date != y->due_date) return x->due_date < y->due_date ? -1 : 1;
+    return x->idx - y->idx;
+}
+
+// First position whose entry is not before (due_date, idx)
+int due_lower_bound(int64_t due_date, int idx) {
+    int lo = 0, hi = due_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        DueEntry *entry = &due_index[mid];
+        if (entry->due_date < due_date || (entry->due_date == due_date && entry->idx < idx)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void due_insert(int64_t due_date, int idx) {
+    if (due_count == due_capacity) {
+        due_capacity = due_capacity ? due_capacity * 2 : INITIAL_TODO_CAPACITY;
+        due_index = xrealloc(due_index, due_capacity * sizeof(DueEntry));
+    }
+    int pos = due_lower_bound(due_date, idx);
+    memmove(&due_index[pos + 1], &due_index[pos], (due_count - pos) * sizeof(DueEntry));
+    due_index[pos].due_date = due_date;
+    due_index[pos].idx = idx;
+    due_count++;
+}
+
+void due_remove(int64_t due_date, int idx) {
+    int pos = due_lower_bound(due_date, idx);
+    if (pos == due_count || due_index[pos].idx != idx) return;
+    memmove(&due_index[pos], &due_index[pos + 1], (due_count - pos - 1) * sizeof(DueEntry));
+    due_count--;
+}
+
+int compare_index(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Orders todos x and y by a sort, ties in list order, so that every todo
+// has exactly one place in it. Category keys must be current; text keys
+// are derived on the fly until a text order needs them all.
+int compare_todos(int x, int y, int mode) {
+    if (mode == SORT_DUE) {
+        int64_t dx = todos[x].due_date > 0 ? todos[x].due_date : INT64_MAX;
+        int64_t dy = todos[y].due_date > 0 ? todos[y].due_date : INT64_MAX;
+        if (dx != dy) return dx < dy ? -1 : 1;
+    } else if (mode == SORT_CATEGORY) {
+        int cx = todos[x].category_id, cy = todos[y].category_id;
+        if (cx != cy) {
+            if (category_keys[cx] != category_keys[cy]) return category_keys[cx] < category_keys[cy] ? -1 : 1;
+            int order = strcasecmp(category_name(cx), category_name(cy));
+            if (order != 0) return order;
+        }
+    } else if (mode == SORT_TEXT) {
+        uint64_t kx = text_keys_ready ? text_keys[x] : sort_key(todo_text(x));
+        uint64_t ky = text_keys_ready ? text_keys[y] : sort_key(todo_text(y));
+        if (kx != ky) return kx < ky ? -1 : 1;
+        // Equal keys mean both texts share their first 8 bytes, so if
+        // either is longer the other is at least 8 long
+        if (todos[x].text_len > 8 || todos[y].text_len > 8) {
+            int order = strcasecmp(todo_text(x) + 8, todo_text(y) + 8);
+            if (order != 0) return order;
+        }
+    } else if (mode == SORT_CREATED) {
+        if (todos[x].created_at != todos[y].created_at) return todos[x].created_at < todos[y].created_at ? -1 : 1;
+    }
+    return x - y;
+}
+
+int compare_sorted(const void *a, const void *b) {
+    return compare_todos(*(const int *)a, *(const int *)b, sorting_mode);
+}
+
+void sort_indices(IndexList *list) {
+    prepare_sort_keys(sort_mode, list->count > todo_count / 16);
+    sorting_mode = sort_mode;
+    qsort(list->items, list->count, sizeof(int), compare_sorted);
+}
+
+// First 8 bytes of str, case-folded and padded with NULs, big-endian so
+// that integer order is strcasecmp() order
+uint64_t sort_key(const char *str) {
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key = key << 8 | (unsigned char)tolower((unsigned char)*str);
+        if (*str) str++;
+    }
+    return key;
+}
+
+// Categories are only ever added, so only the new ones need keys
+void update_category_keys() {
+    if (category_key_count == category_count) return;
+    category_keys = xrealloc(category_keys, category_capacity * sizeof(uint64_t));
+    for (; category_key_count < category_count; category_key_count++) {
+        int id = category_key_count;
+        category_keys[id] = id == CATEGORY_NONE ? UINT64_MAX : sort_key(category_name(id));
+    }
+}
+
+// Makes sure compare_todos() can compare under mode, with every text key
+// precomputed if all is set
+void prepare_sort_keys(int mode, int all) {
+    if (mode == SORT_CATEGORY) update_category_keys();
+    if (mode == SORT_TEXT && all && !text_keys_ready) {
+        if (text_key_capacity < todo_capacity) {
+            text_key_capacity = todo_capacity;
+            text_keys = xrealloc(text_keys, text_key_capacity * sizeof(uint64_t));
+        }
+        for (int i = 0; i < todo_count; i++) text_keys[i] = sort_key(todo_text(i));
+        text_keys_ready = 1;
+    }
+}
+
+// Builds the order of a sort with one qsort() if it does not exist yet
+void build_sort_order(int mode) {
+    prepare_sort_keys(mode, 1);
+    if (mode < SORT_CATEGORY || sort_ready[mode]) return;
+
+    IndexList *order = &sort_orders[mode];
+    order->count = 0;
+    for (int i = 0; i < todo_count; i++) list_push(order, i);
+    sorting_mode = mode;
+    qsort(order->items, order->count, sizeof(int), compare_sorted);
+    sort_ready[mode] = 1;
+}
+
+// Left to be rebuilt by the next view that needs them, like the other
+// indexes after a bulk change
+void drop_sort_orders() {
+    for (int mode = 0; mode < SORT_MODES; mode++) sort_ready[mode] = 0;
+    text_keys_ready = 0;
+}
+
+// Position of idx in list, which is in the order of mode, or where it would go
+int sort_position(const IndexList *list, int idx, int mode) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare_todos(list->items[mid], idx, mode) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Adds a new or changed todo to a built order; sort_remove() must have
+// taken it out under its old key first
+void sort_insert(int mode, int idx) {
+    if (mode == SORT_TEXT && text_keys_ready) {
+        if (text_key_capacity < todo_count) {
+            text_key_capacity = todo_capacity;
+            text_keys = xrealloc(text_keys, text_key_capacity * sizeof(uint64_t));
+        }
+        text_keys[idx] = sort_key(todo_text(idx));
+    }
+    if (!sort_ready[mode]) return;
+    if (mode == SORT_CATEGORY) update_category_keys();
+
+    IndexList *order = &sort_orders[mode];
+    int pos = sort_position(order, idx, mode);
+    list_push(order, idx);
+    memmove(&order->items[pos + 1], &order->items[pos], (order->count - pos - 1) * sizeof(int));
+    order->items[pos] = idx;
+}
+
+void sort_remove(int mode, int idx) {
+    if (!sort_ready[mode]) return;
+    IndexList *order = &sort_orders[mode];
+    int pos = sort_position(order, idx, mode);
+    if (pos == order->count || order->items[pos] != idx) return;
+    memmove(&order->items[pos], &order->items[pos + 1], (order->count - pos - 1) * sizeof(int));
+    order->count--;
+}
+
+const char* sort_name(int mode) {
+    static const char *names[SORT_MODES] = {"List", "Due", "Category", "Text", "Created"};
+    return names[mode];
+}
+
+// Called by every change to the todos or the filters; the view is rebuilt
+// lazily by the next refresh_view() so several changes cost one scan
+void invalidate_view() {
+    view_dirty = 1;
+}
+
+// Moves a todo whose fields changed to where it now belongs in a clean
+// view, or out of it, instead of rebuilding the view. A new category may
+// change what the plan resolved names to, so it rebuilds.
+void view_update(int idx) {
+    if (view_dirty) return;
+    if (view_plan.source == PLAN_EMPTY || category_count != view_categories) {
+        invalidate_view();
+        return;
+    }
+    view_remove(idx);
+    if (view_streaming && idx >= view_next) return; // The stream gets to it
+    if (!todo_matches_plan(idx)) return;
+
+    prepare_sort_keys(sort_mode, 0);
+    int pos = sort_position(&view, idx, sort_mode);
+    list_push(&view, idx);
+    memmove(&view.items[pos + 1], &view.items[pos], (view.count - pos - 1) * sizeof(int));
+    view.items[pos] = idx;
+}
+
+// Position of idx in the view, or -1; the view is always in sort order
+int view_find(int idx) {
+    refresh_view();
+    while (view_streaming && idx >= view_next) stream_view(view.count + 1);
+    prepare_sort_keys(sort_mode, 0);
+    int pos = sort_position(&view, idx, sort_mode);
+    return pos < view.count && view.items[pos] == idx ? pos : -1;
+}
+
+// Drops a deleted todo from a clean view without rebuilding it. The todo is
+// almost always the selected row, so that slot is checked first.
+void view_remove(int idx) {
+    if (view_dirty) return;
+
+    int pos = selected;
+    if (pos < 0 || pos >= view.count || view.items[pos] != idx) {
+        for (pos = 0; pos < view.count && view.items[pos] != idx; pos++) {}
+        if (pos == view.count) return;
+    }
+    memmove(&view.items[pos], &view.items[pos + 1], (view.count - pos - 1) * sizeof(int));
+    view.count--;
+}
+
+// Candidates come from whichever index the plan picked, else from a scan.
+// Walking the due index or a sort order already yields that order, so a
+// sorted view over the whole list walks it instead when no index narrows
+// the view. While the index thread runs, every view is a scan.
+void refresh_view() {
+    static IndexList candidates;
+    if (!view_dirty) return;
+
+    PROFILE_BEGIN(view);
+    view_now = time(NULL);
+    view.count = 0;
+    view_streaming = 0;
+    plan_view();
+
+    QueryPlan *plan = &view_plan;
+    int due_sorted = plan->source == PLAN_SCAN && sort_mode == SORT_DUE && !index_build_pending();
+    if (due_sorted) {
+        if (!due_ready) build_due_index();
+        plan->first = 0;
+        plan->last = due_count;
+    }
+
+    if (plan->source == PLAN_EMPTY) {
+        // Some term matches nothing
+    } else if (plan->source == PLAN_SCAN && sort_mode >= SORT_CATEGORY) {
+        build_sort_order(sort_mode);
+        IndexList *order = &sort_orders[sort_mode];
+        for (int n = 0; n < order->count; n++) {
+            if (todo_matches_filter(order->items[n])) list_push(&view, order->items[n]);
+        }
+    } else if (plan->source == PLAN_DUE || due_sorted) {
+        for (int n = plan->first; n < plan->last; n++) {
+            if (todo_matches_filter(due_index[n].idx)) list_push(&view, due_index[n].idx);
+        }
+        if (due_sorted) {
+            for (int i = 0; i < todo_count; i++) {
+                if (todos[i].due_date <= 0 && todo_matches_filter(i)) list_push(&view, i);
+            }
+        } else if (sort_mode != SORT_DUE) {
+            sort_indices(&view);
+        }
+    } else {
+        if (plan->source == PLAN_TRIGRAM &&
+            trigram_candidates(plan->query.terms[plan->search].text, &candidates)) {
+            for (int n = 0; n < candidates.count; n++) {
+                if (todo_matches_filter(candidates.items[n])) list_push(&view, candidates.items[n]);
+            }
+        } else if (sort_mode == SORT_NONE && view_stream) {
+            view_next = 0;
+            view_streaming = 1;
+            stream_view(LINES);
+        } else {
+            scan_view(&view);
+        }
+        if (sort_mode != SORT_NONE) sort_indices(&view);
+    }
+    view_dirty = 0;
+#ifdef TODO_PROFILE
+    int searched = 0;
+    for (int n = 0; n < plan->query.count; n++) searched |= plan->query.terms[n].kind == TERM_TEXT;
+    PROFILE_END(view, searched ? SPAN_SEARCH : SPAN_FILTER);
+#endif
+}
+
+// Checks the terms the plan did not already satisfy through its index
+int todo_matches_filter(int idx) {
+    PROFILE_COUNT(profile_scanned, 1);
+    if (todos[idx].flags & TODO_DELETED) {
+        return 0;
+    }
+    for (int n = 0; n < view_plan.check_count; n++) {
+        if (!term_matches(&view_plan.query.terms[view_plan.checks[n]], idx)) return 0;
+    }
+    return 1;
+}
+
+// Keeps every slot that passes the plan's checks, in slot order
+void scan_view(IndexList *out) {
+    scan_slots(out, 0, todo_count);
+}
+
+// Scans on from view_next until the view holds rows todos or the scan
+// reaches the last slot. The first screenful is scanned a chunk at a time;
+// each later step doubles the slots scanned, so a long way down they go to
+// the pool.
+void stream_view(int rows) {
+    while (view_streaming && view.count < rows) {
+        int span = view_next < SCAN_CHUNK ? SCAN_CHUNK : view_next;
+        int last = todo_count - view_next < span ? todo_count : view_next + span;
+        scan_slots(&view, view_next, last);
+        view_next = last;
+        if (view_next == todo_count) view_streaming = 0;
+    }
+}
+
+// Appends the slots in [first, last) that pass the plan's checks, in slot
+// order; first is a multiple of SCAN_CHUNK. A long range goes to the scan
+// pool.
+void scan_slots(IndexList *out, int first, int last) {
+    if (!columns_ready) build_columns();
+    long scanned = last - first < SCAN_MIN_PARALLEL || !start_scan_pool() ? scan_range(out, first, last)
+                                                                        : scan_pooled(out, first, last);
+    PROFILE_COUNT(profile_scanned, scanned);
+    (void)scanned; // Only counted by profiling builds
+}
+
+// Cuts the range into chunks spread over the scan pool and this thread.
+// Each chunk's matches go to a list of its own, appended in chunk order
+// once every worker is done. The store does not change meanwhile: the
+// caller is the thread that changes it. Returns the live slots tested.
+long scan_pooled(IndexList *out, int first, int last) {
+    int chunks = (last - first + SCAN_CHUNK - 1) / SCAN_CHUNK;
+    if (chunks > scan_result_capacity) {
+        scan_results = xrealloc(scan_results, chunks * sizeof(IndexList));
+        scan_counts = xrealloc(scan_counts, chunks * sizeof(long));
+        memset(&scan_results[scan_result_capacity], 0,
+               (chunks - scan_result_capacity) * sizeof(IndexList));
+        scan_result_capacity = chunks;
+    }
+    int parts = scan_workers + 1;
+    for (int p = 0; p < parts; p++) {
+        scan_queues[p].head = (int)((int64_t)chunks * p / parts);
+        scan_queues[p].tail = (int)((int64_t)chunks * (p + 1) / parts);
+    }
+    scan_first = first;
+    scan_last = last;
+
+    pthread_mutex_lock(&scan_lock);
+    scan_job++;
+    scan_busy = scan_workers;
+    pthread_cond_broadcast(&scan_wake);
+    pthread_mutex_unlock(&scan_lock);
+    run_scan_queue(0);
+    pthread_mutex_lock(&scan_lock);
+    while (scan_busy > 0) pthread_cond_wait(&scan_done, &scan_lock);
+    pthread_mutex_unlock(&scan_lock);
+
+    long scanned = 0;
+    for (int c = 0; c < chunks; c++) {
+        list_append(out, &scan_results[c]);
+        scanned += scan_counts[c];
+    }
+    return scanned;
+}
+
+// The terms on fields are tested 64 slots at a time against the hot
+// columns, and the text terms only for the slots that pass them. Returns
+// the live slots tested.
+long scan_range(IndexList *out, int first, int last) {
+    int texts[QUERY_MAX_TERMS + QUICK_FILTER_TERMS];
+    int text_count = 0;
+    for (int n = 0; n < view_plan.check_count; n++) {
+        if (view_plan.query.terms[view_plan.checks[n]].kind == TERM_TEXT) {
+            texts[text_count++] = view_plan.checks[n];
+        }
+    }
+
+    long scanned = 0;
+    for (int base = first; base < last; base += 64) {
+        int rows = last - base < 64 ? last - base : 64;
+        uint64_t mask = ~deleted_bits[base / 64];
+        if (rows < 64) mask &= (UINT64_C(1) << rows) - 1;
+        scanned += __builtin_popcountll(mask);
+        for (int n = 0; n < view_plan.check_count && mask; n++) {
+            const QueryTerm *term = &view_plan.query.terms[view_plan.checks[n]];
+            if (term->kind != TERM_TEXT) mask &= column_mask(term, base, rows);
+        }
+        for (; mask; mask &= mask - 1) {
+            int idx = base + __builtin_ctzll(mask);
+            int n = 0;
+            while (n < text_count && term_matches(&view_plan.query.terms[texts[n]], idx)) n++;
+            if (n == text_count) list_push(out, idx);
+        }
+    }
+    return scanned;
+}
+
+// Starts one scan thread per core beside the calling thread, on first use.
+// Returns 0 if there is no other core to share a scan with.
+int start_scan_pool() {
+    if (scan_pool_started) return scan_workers > 0;
+    scan_pool_started = 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > INDEX_MAX_WORKERS) cores = INDEX_MAX_WORKERS;
+    for (int p = 0; p < INDEX_MAX_WORKERS; p++) pthread_mutex_init(&scan_queues[p].lock, NULL);
+    while (scan_workers < cores - 1) {
+        intptr_t self = scan_workers + 1;
+        if (pthread_create(&scan_threads[scan_workers], NULL, scan_worker, (void *)self) != 0) break;
+        scan_workers++;
+    }
+    return scan_workers > 0;
+}
+
+void* scan_worker(void *arg) {
+    int self = (int)(intptr_t)arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&scan_lock);
+    while (1) {
+        while (scan_job == seen) pthread_cond_wait(&scan_wake, &scan_lock);
+        seen = scan_job;
+        pthread_mutex_unlock(&scan_lock);
+        run_scan_queue(self);
+        pthread_mutex_lock(&scan_lock);
+        if (--scan_busy == 0) pthread_cond_signal(&scan_done);
+    }
+    return NULL;
+}
+
+void run_scan_queue(int self) {
+    int chunk;
+    while ((chunk = claim_scan_chunk(self)) >= 0) {
+        IndexList *result = &scan_results[chunk];
+        int first = scan_first + chunk * SCAN_CHUNK;
+        int last = scan_last - first < SCAN_CHUNK ? scan_last : first + SCAN_CHUNK;
+        result->count = 0;
+        scan_counts[chunk] = scan_range(result, first, last);
+    }
+}
+
+// Takes the chunk at the head of this worker's own queue or, once that is
+// empty, steals the one at the tail of another's. Returns -1 when no chunk
+// is left anywhere.
+int claim_scan_chunk(int self) {
+    int parts = scan_workers + 1;
+    for (int n = 0; n < parts; n++) {
+        ScanQueue *queue = &scan_queues[(self + n) % parts];
+        int chunk = -1;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) chunk = n == 0 ? queue->head++ : --queue->tail;
+        pthread_mutex_unlock(&queue->lock);
+        if (chunk >= 0) return chunk;
+    }
+    return -1;
+}
+
+// Bit k is set if slot base + k passes term, which is not a text term
+uint64_t column_mask(const QueryTerm *term, int base, int rows) {
+    uint64_t bits = 0;
+    if (term->kind == TERM_DONE) {
+        bits = done_bits[base / 64];
+    } else if (term->kind == TERM_CATEGORY) {
+        const uint16_t *column = category_column + base;
+        for (int k = 0; k < rows; k++) bits |= (uint64_t)(column[k] == term->category_id) << k;
+    } else {
+        const int64_t *column = due_column + base;
+        for (int k = 0; k < rows; k++) {
+            bits |= (uint64_t)(column[k] >= term->lo && column[k] < term->hi) << k;
+        }
+    }
+    return term->negate ? ~bits : bits;
+}
+
+void build_columns() {
+    columns_ready = 1;
+    if (todo_count > column_capacity) {
+        column_capacity = (todo_count + 63) & ~63;
+        done_bits = xrealloc(done_bits, column_capacity / 8);
+        deleted_bits = xrealloc(deleted_bits, column_capacity / 8);
+        category_column = xrealloc(category_column, column_capacity * sizeof(uint16_t));
+        due_column = xrealloc(due_column, column_capacity * sizeof(int64_t));
+    }
+    memset(done_bits, 0, column_capacity / 8);
+    memset(deleted_bits, 0, column_capacity / 8);
+    for (int i = 0; i < todo_count; i++) update_columns(i);
+}
+
+// Copies the fields of a new or changed todo into the columns, if built
+void update_columns(int idx) {
+    if (!columns_ready) return;
+    if (idx >= column_capacity) {
+        int capacity = column_capacity ? column_capacity * 2 : INITIAL_TODO_CAPACITY;
+        while (capacity <= idx) capacity *= 2;
+        done_bits = xrealloc(done_bits, capacity / 8);
+        deleted_bits = xrealloc(deleted_bits, capacity / 8);
+        memset((char *)done_bits + column_capacity / 8, 0, (capacity - column_capacity) / 8);
+        memset((char *)deleted_bits + column_capacity / 8, 0, (capacity - column_capacity) / 8);
+        category_column = xrealloc(category_column, capacity * sizeof(uint16_t));
+        due_column = xrealloc(due_column, capacity * sizeof(int64_t));
+        column_capacity = capacity;
+    }
+
+    uint64_t bit = UINT64_C(1) << (idx % 64);
+    done_bits[idx / 64] = todos[idx].done ? done_bits[idx / 64] | bit : done_bits[idx / 64] & ~bit;
+    deleted_bits[idx / 64] = todos[idx].flags & TODO_DELETED ? deleted_bits[idx / 64] | bit
+                                                             : deleted_bits[idx / 64] & ~bit;
+    category_column[idx] = todos[idx].category_id;
+    due_column[idx] = todos[idx].due_date;
+}
+
+void build_counters(time_t now) {
+    counters_ready = 1;
+    if (category_count > category_counts_capacity) {
+        category_counts_capacity = category_count;
+        category_counts = xrealloc(category_counts, category_counts_capacity * sizeof(CategoryCount));
+    }
+    memset(category_counts, 0, category_counts_capacity * sizeof(CategoryCount));
+    done_total = overdue_total = 0;
+    overdue_now = now;
+    for (int i = 0; i < todo_count; i++) count_todo(i, 1);
+}
+
+// Adds (sign 1) or takes back (sign -1) what a todo contributes to the
+// counters, from its current fields. Mutations take it back before they
+// change a todo and add it again after.
+void count_todo(int idx, int sign) {
+    const Todo *todo = &todos[idx];
+    if (!counters_ready || (todo->flags & TODO_DELETED)) return;
+    if (todo->category_id >= category_counts_capacity) {
+        int capacity = category_counts_capacity ? category_counts_capacity : INITIAL_CATEGORY_CAPACITY;
+        while (capacity <= todo->category_id) capacity *= 2;
+        category_counts = xrealloc(category_counts, capacity * sizeof(CategoryCount));
+        memset(&category_counts[category_counts_capacity], 0,
+               (capacity - category_counts_capacity) * sizeof(CategoryCount));
+        category_counts_capacity = capacity;
+    }
+
+    category_counts[todo->category_id].total += sign;
+    if (todo->done) {
+        category_counts[todo->category_id].done += sign;
+        done_total += sign;
+    } else if (todo->due_date > 0 && todo->due_date < overdue_now) {
+        overdue_total += sign;
+    }
+}
+
+// Moves overdue_now to now, counting the pending todos that fell due in
+// between, or uncounting them if the clock went back. That range of the
+// due index is empty in most frames. Waits while the index thread runs.
+void advance_overdue(time_t now) {
+    if (now == overdue_now || index_build_pending()) return;
+    if (!due_ready) build_due_index();
+
+    int forward = now > overdue_now;
+    int first = due_lower_bound(forward ? overdue_now : now, INT32_MIN);
+    int last = due_lower_bound(forward ? now : overdue_now, INT32_MIN);
+    for (int n = first; n < last; n++) {
+        const Todo *todo = &todos[due_index[n].idx];
+        if (!todo->done && !(todo->flags & TODO_DELETED)) overdue_total += forward ? 1 : -1;
+    }
+    overdue_now = now;
+}
+
+// Checks every term, including those the plan's index stood in for
+int todo_matches_plan(int idx) {
+    if (todos[idx].flags & TODO_DELETED) return 0;
+    for (int n = 0; n < view_plan.query.count; n++) {
+        if (!term_matches(&view_plan.query.terms[n], idx)) return 0;
+    }
+    return 1;
+}
+
+int term_matches(const QueryTerm *term, int idx) {
+    const Todo *todo = &todos[idx];
+    int match;
+    if (term->kind == TERM_DONE) {
+        match = todo->done != 0;
+    } else if (term->kind == TERM_CATEGORY) {
+        match = todo->category_id == term->category_id;
+    } else if (term->kind == TERM_DUE) {
+        match = todo->due_date >= term->lo && todo->due_date < term->hi;
+    } else {
+        match = todo_contains(idx, term->text, term->text_len);
+    }
+    return match != term->negate;
+}
+
+// Compiles filter_query and the quick filters into view_plan, in the TUI
+// first bringing back the archived todos the view may show
+void plan_view() {
+    Query *query = &view_plan.query;
+    *query = filter_terms;
+    if (filter_done != -1) add_term(query, TERM_DONE, !filter_done, NULL);
+    if (filter_category[0]) add_term(query, TERM_CATEGORY, 0, filter_category);
+    if (filter_due != DUE_ALL) {
+        add_term(query, TERM_DONE, 1, NULL);
+        QueryTerm *term = add_term(query, TERM_DUE, 0, NULL);
+        term->op = filter_due == DUE_OVERDUE ? '<' : 'g';
+        term->relative = 1;
+    }
+    if (search_term[0]) add_term(query, TERM_TEXT, 0, search_term);
+    if (view_thaws) thaw_archive(query, view_now);
+    plan_query(&view_plan, view_now);
+    view_categories = category_count;
+}
+
+QueryTerm* add_term(Query *query, int kind, int negate, const char *text) {
+    QueryTerm *term = &query->terms[query->count++];
+    memset(term, 0, offsetof(QueryTerm, text));
+    term->kind = kind;
+    term->negate = negate;
+    snprintf(term->text, MAX_LENGTH, "%s", text ? text : "");
+    return term;
+}
+
+// Parses a filter expression. On a malformed term returns 0 and points
+// *error at it.
+int compile_query(const char *text, Query *query, const char **error) {
+    query->count = 0;
+    const char *pos = text;
+    while (1) {
+        while (*pos == ' ' || *pos == '\t') pos++;
+        if (*pos == '\0') return 1;
+        *error = pos;
+        if (query->count == QUERY_MAX_TERMS) return 0;
+
+        int negate = *pos == '!';
+        if (negate) pos++;
+
+        // A term runs to the next blank outside quotes
+        char word[MAX_LENGTH];
+        size_t len = 0;
+        int quoted = 0, in_quotes = 0;
+        for (; *pos && (in_quotes || (*pos != ' ' && *pos != '\t')); pos++) {
+            if (*pos == '"') {
+                in_quotes = !in_quotes;
+                quoted = 1;
+            } else if (len < MAX_LENGTH - 1) {
+                word[len++] = *pos;
+            }
+        }
+        word[len] = '\0';
+        if (in_quotes) return 0;
+
+        if (quoted && strchr(*error + negate, '"') == *error + negate) {
+            if (len == 0) return 0;
+            add_term(query, TERM_TEXT, negate, word);
+        } else if (strcmp(word, "done") == 0 || strcmp(word, "pending") == 0) {
+            add_term(query, TERM_DONE, negate ^ (word[0] == 'p'), NULL);
+        } else if (strcmp(word, "overdue") == 0 || strcmp(word, "upcoming") == 0) {
+            if (negate || query->count + 2 > QUERY_MAX_TERMS) return 0;
+            add_term(query, TERM_DONE, 1, NULL);
+            QueryTerm *term = add_term(query, TERM_DUE, 0, NULL);
+            term->op = word[0] == 'o' ? '<' : 'g';
+            term->relative = 1;
+        } else if (strncmp(word, "cat:", 4) == 0 || strncmp(word, "category:", 9) == 0) {
+            add_term(query, TERM_CATEGORY, negate, strchr(word, ':') + 1);
+        } else if (strncmp(word, "due", 3) == 0 && strchr("<>=", word[3])) {
+            if (!compile_due_term(add_term(query, TERM_DUE, negate, NULL), word + 3)) return 0;
+        } else {
+            add_term(query, TERM_TEXT, negate, word);
+        }
+    }
+}
+
+// Reads the comparison after "due": an operator, then none, today, a date
+// or a signed number of days or weeks from now
+int compile_due_term(QueryTerm *term, const char *str) {
+    term->op = *str++;
+    if (*str == '=' && term->op != '=') {
+        term->op = term->op == '<' ? 'l' : 'g';
+        str++;
+    }
+
+    char *end;
+    long amount = strtol(str, &end, 10);
+    time_t date;
+    if (strcmp(str, "none") == 0) {
+        if (term->op != '=') return 0;
+        term->op = 'n';
+    } else if (strcmp(str, "today") == 0) {
+        term->relative = 1;
+    } else if (end != str && isdigit((unsigned char)end[-1]) && (*end == 'd' || *end == 'w') &&
+               end[1] == '\0') {
+        term->relative = 1;
+        term->value = (int64_t)amount * (*end == 'w' ? 7 : 1) * DAY_SECONDS;
+    } else if (str[0] && parse_date(str, &date) && date > 0) {
+        term->value = date;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Resolves the terms against the store, estimates how many todos pass each
+// from the indexes, then takes the candidates from whichever index yields
+// the fewest and orders the remaining checks so that cheap terms most
+// likely to reject a todo run first. The indexes still hold tombstones, so
+// the estimates are rough; the plan is only empty on exact facts: an
+// unknown category, an empty due range or a trigram no todo has.
+void plan_query(QueryPlan *plan, time_t now) {
+    Query *query = &plan->query;
+    int live = todo_count - deleted_count;
+    int indexed = !index_build_pending();
+    int64_t due_lo = 1, due_hi = INT64_MAX; // Dated todos every positive due term allows
+    int search = -1;
+    double search_pass = 1;
+    int empty = 0;
+
+    plan->source = PLAN_SCAN;
+    for (int n = 0; n < query->count; n++) {
+        QueryTerm *term = &query->terms[n];
+        double pass = 0.5;
+        if (term->kind == TERM_CATEGORY) {
+            term->category_id = term->text[0] ? find_category(term->text) : CATEGORY_NONE;
+            pass = term->category_id < 0 ? 0 : 1.0 / (category_count > 1 ? category_count : 2);
+            if (term->category_id < 0 && !term->negate) empty = 1;
+        } else if (term->kind == TERM_DUE) {
+            resolve_due_term(term, now);
+            if (indexed && live > 0) {
+                if (!due_ready) build_due_index();
+                int first = due_lower_bound(term->lo, INT32_MIN);
+                int last = due_lower_bound(term->hi, INT32_MIN);
+                pass = term->op == 'n' ? (double)(live - due_count) / live : (double)(last - first) / live;
+                if (first == last && term->op != 'n' && !term->negate) empty = 1;
+            }
+            if (!term->negate && term->op != 'n') {
+                if (term->lo > due_lo) due_lo = term->lo;
+                if (term->hi < due_hi) due_hi = term->hi;
+            }
+        } else if (term->kind == TERM_TEXT) {
+            term->text_len = fold_ascii(term->text, term->text);
+            int estimate = indexed ? trigram_estimate(term->text) : -1;
+            if (estimate >= 0) pass = live > 0 ? (double)estimate / live : 0;
+            if (estimate == 0 && !term->negate) empty = 1;
+            if (estimate >= 0 && !term->negate && pass <= search_pass) {
+                search = n;
+                search_pass = pass;
+            }
+        }
+        if (pass < 0) pass = 0;
+        if (pass > 1) pass = 1;
+        term->pass = term->negate ? 1 - pass : pass;
+    }
+    if (empty || due_lo >= due_hi) {
+        plan->source = PLAN_EMPTY;
+        plan->check_count = 0;
+        return;
+    }
+
+    // The due index gives an exact range; trigram postings only a superset
+    // of the matching text
+    double due_pass = 1;
+    if (indexed && (due_lo > 1 || due_hi < INT64_MAX)) {
+        if (!due_ready) build_due_index();
+        plan->first = due_lower_bound(due_lo, INT32_MIN);
+        plan->last = due_lower_bound(due_hi, INT32_MIN);
+        due_pass = live > 0 ? (double)(plan->last - plan->first) / live : 0;
+        plan->source = PLAN_DUE;
+    }
+    if (search >= 0 && search_pass < due_pass) {
+        plan->source = PLAN_TRIGRAM;
+        plan->search = search;
+    }
+
+    plan->check_count = 0;
+    for (int n = 0; n < query->count; n++) {
+        QueryTerm *term = &query->terms[n];
+        if (plan->source == PLAN_DUE && term->kind == TERM_DUE && !term->negate && term->op != 'n') {
+            continue;
+        }
+        int pos = plan->check_count++;
+        while (pos > 0 && check_rank(&query->terms[plan->checks[pos - 1]]) > check_rank(term)) {
+            plan->checks[pos] = plan->checks[pos - 1];
+            pos--;
+        }
+        plan->checks[pos] = n;
+    }
+}
+
+// Cost of a check per todo it rejects
+double check_rank(const QueryTerm *term) {
+    double cost = term->kind == TERM_TEXT ? TEXT_CHECK_COST : 1;
+    return term->pass >= 1 ? cost * 1e9 : cost / (1 - term->pass);
+}
+
+void resolve_due_term(QueryTerm *term, time_t now) {
+    int64_t date = term->relative ? now + term->value : term->value;
+    term->lo = 1;
+    term->hi = INT64_MAX;
+    if (term->op == 'n') {
+        term->lo = INT64_MIN;
+        term->hi = 1;
+    } else if (term->op == '<') {
+        term->hi = date;
+    } else if (term->op == 'l') {
+        term->hi = date + 1;
+    } else if (term->op == '>') {
+        term->lo = date + 1;
+    } else if (term->op == 'g') {
+        term->lo = date;
+    } else {
+        // The whole local day, which is not always 24 hours long
+        struct tm tm_day;
+        time_t day = date;
+        localtime_r(&day, &tm_day);
+        tm_day.tm_hour = tm_day.tm_min = tm_day.tm_sec = 0;
+        tm_day.tm_isdst = -1;
+        term->lo = mktime(&tm_day);
+        tm_day.tm_mday++;
+        tm_day.tm_isdst = -1;
+        term->hi = mktime(&tm_day);
+    }
+    if (term->lo < 1 && term->op != 'n') term->lo = 1;
+}
+
+// Upper bound on the todos containing term: its rarest trigram's postings.
+// Returns -1 if the term is too short to use the index.
+int trigram_estimate(const char *term) {
+    size_t len = strlen(term);
+    if (len < TRIGRAM_LEN || index_build_pending()) return -1;
+    if (!trigram_ready) build_trigram_index();
+
+    int estimate = INT32_MAX;
+    for (size_t i = 0; i + TRIGRAM_LEN <= len; i++) {
+        IndexList *postings = trigram_postings(&trigrams, make_trigram(term + i), 0);
+        int count = postings ? postings->count : 0;
+        if (count < estimate) estimate = count;
+    }
+    return estimate;
+}
+
+// Whether the text or the category name of a todo contains needle, which
+// fold_ascii() lowered; like strcasestr() in the C locale, only ASCII
+// letters fold
+int todo_contains(int idx, const char *needle, size_t len) {
+    const Category *category = &categories[todos[idx].category_id];
+    return find_folded(todo_text(idx), todos[idx].text_len, needle, len) ||
+           find_folded(category_name(todos[idx].category_id), category->name_len, needle, len);
+}
+
+// Uses the widest vector unit the CPU has, unless $TODO_MATCHER names one
+// (scalar, sse2 or avx2) for comparing them
+void select_matcher() {
+    const char *name = getenv("TODO_MATCHER");
+    find_folded = find_folded_scalar;
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (!name || strcmp(name, "scalar") != 0) find_folded = find_folded_sse2;
+    if ((!name || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        find_folded = find_folded_avx2;
+    }
+#else
+    (void)name;
+#endif
+}
+
+size_t fold_ascii(char *dst, const char *src) {
+    size_t len = 0;
+    for (; src[len]; len++) {
+        dst[len] = src[len] >= 'A' && src[len] <= 'Z' ? src[len] + ('a' - 'A') : src[len];
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+int fold_byte(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// Compares len bytes of hay, folded, with the folded needle
+int folded_equal(const char *hay, const char *needle, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (fold_byte(hay[i]) != (unsigned char)needle[i]) return 0;
+    }
+    return 1;
+}
+
+int find_folded_scalar(const char *hay, size_t hay_len, const char *needle, size_t len) {
+    for (size_t i = 0; i + len <= hay_len; i++) {
+        if (len == 0 || (fold_byte(hay[i]) == (unsigned char)needle[0] &&
+                         folded_equal(hay + i + 1, needle + 1, len - 1))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef __x86_64__
+// The vector matchers compare the first and last needle byte against a
+// block of candidate starts at once, and only check the bytes in between
+// where both match. The final block may read past the string as long as
+// it stays inside the page; its candidates past the end are masked off.
+
+// Whether a width-byte load at p stays inside p's page
+int block_readable(const char *p, size_t width) {
+    return ((uintptr_t)p & 4095) <= 4096 - width;
+}
+
+__m128i fold_sse2(__m128i x) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+
+int find_folded_sse2(const char *hay, size_t hay_len, const char *needle, size_t len) {
+    if (len == 0) return 1;
+    if (len > hay_len) return 0;
+
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[len - 1]);
+    size_t starts = hay_len - len + 1;
+    for (size_t i = 0; i < starts; i += 16) {
+        const char *block = hay + i;
+        if (i + 16 > starts && !(block_readable(block, 16) && block_readable(block + len - 1, 16))) {
+            return find_folded_scalar(block, hay_len - i, needle, len);
+        }
+        __m128i head = fold_sse2(_mm_loadu_si128((const __m128i *)block));
+        __m128i tail = fold_sse2(_mm_loadu_si128((const __m128i *)(block + len - 1)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first),
+                                                        _mm_cmpeq_epi8(tail, last)));
+        if (starts - i < 16) mask &= (1u << (starts - i)) - 1;
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (len <= 2 || folded_equal(block + bit + 1, needle + 1, len - 2)) return 1;
+            mask &= mask - 1;
+        }
+    }
+    return 0;
+}
+
+__attribute__((target("avx2"))) __m256i fold_avx2(__m256i x) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8('a' - 'A')));
+}
+
+__attribute__((target("avx2")))
+int find_folded_avx2(const char *hay, size_t hay_len, const char *needle, size_t len) {
+    // Shorter strings, most todo texts, are faster a half block at a time
+    if (len == 0 || hay_len < 32 + len) return find_folded_sse2(hay, hay_len, needle, len);
+
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[len - 1]);
+    size_t starts = hay_len - len + 1;
+    for (size_t i = 0; i < starts; i += 32) {
+        const char *block = hay + i;
+        if (i + 32 > starts && !(block_readable(block, 32) && block_readable(block + len - 1, 32))) {
+            return find_folded_sse2(block, hay_len - i, needle, len);
+        }
+        __m256i head = fold_avx2(_mm256_loadu_si256((const __m256i *)block));
+        __m256i tail = fold_avx2(_mm256_loadu_si256((const __m256i *)(block + len - 1)));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                              _mm256_cmpeq_epi8(tail, last)));
+        if (starts - i < 32) mask &= (1u << (starts - i)) - 1;
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (len <= 2 || folded_equal(block + bit + 1, needle + 1, len - 2)) return 1;
+            mask &= mask - 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+// Parses YYYY-MM-DD; a blank string clears the date
+int parse_date(const char *str, time_t *date) {
+    *date = 0;
+    if (str[0] == '\0') return 1;
+
+    struct tm tm_date = {0};
+    if (sscanf(str, "%d-%d-%d", &tm_date.tm_year, &tm_date.tm_mon, &tm_date.tm_mday) != 3) return 0;
+    tm_date.tm_year -= 1900; // Years since 1900
+    tm_date.tm_mon -= 1;     // Months are 0-11
+    tm_date.tm_isdst = -1;
+    *date = mktime(&tm_date);
+    return 1;
+}
+
+// Writes date as YYYY-MM-DD into buffer (DATE_LENGTH bytes). Due dates are
+// whole days, so each distinct one is converted once and then served from a
+// small direct-mapped cache indexed by day.
+void format_date(time_t date, char *buffer) {
+    static DateCacheEntry cache[DATE_CACHE_SIZE];
+    DateCacheEntry *entry = &cache[(uint64_t)(date / DAY_SECONDS) % DATE_CACHE_SIZE];
+
+    if (entry->date != date || entry->text[0] == '\0') {
+        struct tm tm_info;
+        localtime_r(&date, &tm_info);
+        strftime(entry->text, DATE_LENGTH, "%Y-%m-%d", &tm_info);
+        entry->date = date;
+    }
+    memcpy(buffer, entry->text, DATE_LENGTH);
+}
+
+// Reads a recurrence rule: daily, weekly, monthly, or a number of days (d),
+// weeks (w) or months (m) between occurrences. Blank clears the rule. A
+// monthly rule may end in @ and the day of the month it keeps, as export
+// writes it.
+int parse_repeat(const char *str, uint32_t *repeat) {
+    char rule[REPEAT_LENGTH];
+    uint32_t day = 0;
+    const char *at = strchr(str, '@');
+    if (at) {
+        char *end;
+        long number = strtol(at + 1, &end, 10);
+        if (!isdigit((unsigned char)at[1]) || *end != '\0' || number < 1 || number > 31 ||
+            (size_t)(at - str) >= sizeof(rule)) {
+            return 0;
+        }
+        day = number;
+        memcpy(rule, str, at - str);
+        rule[at - str] = '\0';
+        str = rule;
+    }
+
+    static const char *names[] = {"", "daily", "weekly", "monthly"};
+    static const char units[] = "dwm";
+    *repeat = 0;
+    for (int unit = REPEAT_NONE; unit <= REPEAT_MONTHS && !*repeat; unit++) {
+        if (strcasecmp(str, names[unit]) == 0) {
+            if (unit == REPEAT_NONE) return !at;
+            *repeat = 1 << 2 | unit;
+        }
+    }
+    if (!*repeat) {
+        char *end;
+        long every = strtol(str, &end, 10);
+        const char *unit = *end ? strchr(units, tolower((unsigned char)*end)) : NULL;
+        if (!isdigit((unsigned char)str[0]) || every < 1 || every > REPEAT_MAX || !unit ||
+            end[1] != '\0') {
+            return 0;
+        }
+        *repeat = (uint32_t)every << 2 | (REPEAT_DAYS + (unit - units));
+    }
+    if (day && (*repeat & 3) != REPEAT_MONTHS) return 0;
+    *repeat |= day << REPEAT_DAY_SHIFT;
+    return 1;
+}
+
+// Writes the rule the way parse_repeat() reads it into buffer
+// (REPEAT_LENGTH bytes)
+void format_repeat(uint32_t repeat, char *buffer) {
+    static const char *names[] = {"", "daily", "weekly", "monthly"};
+    int unit = repeat & 3;
+    unsigned every = (repeat >> 2) & ((1u << (REPEAT_DAY_SHIFT - 2)) - 1);
+    if (every == 1) {
+        snprintf(buffer, REPEAT_LENGTH, "%s", names[unit]);
+    } else {
+        snprintf(buffer, REPEAT_LENGTH, "%u%c", every > REPEAT_MAX ? REPEAT_MAX : every, "-dwm"[unit]);
+    }
+}
+
+// The first occurrence of a series after both its current one and now; an
+// undated series counts from today. Monthly series keep the day of the
+// month in their rule, falling back to the last day of shorter months. A
+// due date that is not that day, clamped, was moved by hand, and its own
+// day is kept instead.
+time_t next_occurrence(time_t due_date, uint32_t repeat, time_t now) {
+    int unit = repeat & 3;
+    int64_t every = (repeat >> 2) & ((1u << (REPEAT_DAY_SHIFT - 2)) - 1);
+    if (due_date <= 0) due_date = start_of_day(now);
+
+    struct tm base, current;
+    localtime_r(&due_date, &base);
+    localtime_r(&now, &current);
+    int day = repeat >> REPEAT_DAY_SHIFT;
+    int base_days = days_in_month(base.tm_year, base.tm_mon);
+    if (!day || base.tm_mday != (day < base_days ? day : base_days)) day = base.tm_mday;
+
+    // Skip the occurrences already missed in one go, however long ago the
+    // series was last completed
+    int64_t step = 1;
+    if (unit == REPEAT_MONTHS) {
+        int64_t months = (int64_t)(current.tm_year - base.tm_year) * 12 + current.tm_mon - base.tm_mon;
+        if (months / every > step) step = months / every;
+    } else if (now > due_date) {
+        int64_t period = every * (unit == REPEAT_WEEKS ? 7 : 1) * DAY_SECONDS;
+        if ((now - due_date) / period > step) step = (now - due_date) / period;
+    }
+
+    for (;; step++) {
+        struct tm tm = base;
+        tm.tm_isdst = -1;
+        if (unit == REPEAT_MONTHS) {
+            int64_t month = tm.tm_mon + step * every;
+            tm.tm_year += month / 12;
+            tm.tm_mon = month % 12;
+            int days = days_in_month(tm.tm_year, tm.tm_mon);
+            tm.tm_mday = day < days ? day : days;
+        } else {
+            tm.tm_mday += step * every * (unit == REPEAT_WEEKS ? 7 : 1);
+        }
+        time_t next = mktime(&tm);
+        if (next > now) return next;
+    }
+}
+
+// Local midnight at the start of now's day
+time_t start_of_day(time_t now) {
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// month is 0-11 and year counts from 1900, as in struct tm
+int days_in_month(int year, int month) {
+    struct tm tm = {0};
+    tm.tm_year = year;
+    tm.tm_mon = month + 1;
+    tm.tm_mday = 0; // The last day of the month before
+    tm.tm_hour = 12;
+    tm.tm_isdst = -1;
+    mktime(&tm);
+    return tm.tm_mday;
+}
+
+void init_store() {
+    todo_capacity = INITIAL_TODO_CAPACITY;
+    todos = xrealloc(NULL, todo_capacity * sizeof(Todo));
+
+    pool_capacity = INITIAL_POOL_CAPACITY;
+    string_pool = xrealloc(NULL, pool_capacity);
+    string_pool[0] = '\0';
+    pool_size = 1;
+
+    category_capacity = INITIAL_CATEGORY_CAPACITY;
+    categories = xrealloc(NULL, category_capacity * sizeof(Category));
+    memset(&categories[CATEGORY_NONE], 0, sizeof(Category));
+    category_count = 1;
+    grow_category_buckets();
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    void *result = realloc(ptr, size);
+    if (!result) {
+        endwin();
+        fprintf(stderr, "minimal-todo: out of memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+// Arrays loaded from the data file point into its private mapping, which
+// cannot be realloc'ed; they move to the heap the first time they grow.
+void *grow_buffer(void *ptr, size_t used, size_t size) {
+    if (map_base && (char *)ptr >= map_base && (char *)ptr < map_base + map_size) {
+        void *copy = xrealloc(NULL, size);
+        memcpy(copy, ptr, used);
+        return copy;
+    }
+    return xrealloc(ptr, size);
+}
+
+// Copies len bytes plus a terminating NUL into the pool, returns the offset
+uint32_t pool_add(const char *str, size_t len) {
+    if (len == 0) return 0;
+
+    if (pool_size + len + 1 > pool_capacity) {
+        while (pool_size + len + 1 > pool_capacity) pool_capacity *= 2;
+        string_pool = grow_buffer(string_pool, pool_size, pool_capacity);
+    }
+
+    uint32_t offset = pool_size;
+    memcpy(string_pool + offset, str, len);
+    string_pool[offset + len] = '\0';
+    pool_size += len + 1;
+    return offset;
+}
+
+const char* todo_text(int idx) {
+    return string_pool + todos[idx].text_off;
+}
+
+// The recurrence rule of the todo, or 0
+uint32_t todo_repeat(int idx) {
+    uint32_t repeat = todos[idx].flags >> REPEAT_SHIFT;
+    return valid_repeat(repeat) ? repeat : 0;
+}
+
+int valid_repeat(uint32_t repeat) {
+    uint32_t every = (repeat >> 2) & ((1u << (REPEAT_DAY_SHIFT - 2)) - 1);
+    return (repeat & 3) != REPEAT_NONE && every >= 1 && every <= REPEAT_MAX &&
+           repeat >> REPEAT_DAY_SHIFT <= 31;
+}
+
+const char* todo_category(int idx) {
+    return category_name(todos[idx].category_id);
+}
+
+// In-memory mutations, shared by the prompts and by journal replay. They
+// keep the indexes and the view in step but never touch the disk.
+int store_add(const char *text, size_t len, uint64_t uid, int64_t created_at) {
+    finish_index_build();
+    Todo *todo = new_todo();
+    todo->uid = uid;
+    todo->created_at = created_at;
+    todo->text_off = pool_add(text, len);
+    todo->text_len = len;
+    int idx = todo_count - 1;
+    uid_insert(idx);
+    update_columns(idx);
+    count_todo(idx, 1);
+    index_todo(idx);
+    for (int mode = SORT_CATEGORY; mode < SORT_MODES; mode++) sort_insert(mode, idx);
+    view_update(idx);
+    return idx;
+}
+
+// Deleting only tombstones the slot, so every other index stays valid. The
+// trigram and due-date entries of a tombstone are left in place, since
+// todo_matches_filter() rejects it; compact_store() drops them later.
+void store_delete(int idx) {
+    finish_index_build();
+    count_todo(idx, -1);
+    todos[idx].flags |= TODO_DELETED;
+    deleted_count++;
+    update_columns(idx);
+    list_remove_sorted(&marked, idx);
+    view_remove(idx);
+}
+
+// Brings back a deleted todo with the fields it had. Its tombstone is
+// revived in place if compaction has not dropped it yet, so the todo keeps
+// its position in the list; the indexes may have been rebuilt without it,
+// so it is indexed again.
+int store_restore(const RestoreEntry *entry, const char *text, const char *category) {
+    finish_index_build();
+    int idx = find_slot(entry->uid);
+    if (idx >= 0 && !(todos[idx].flags & TODO_DELETED)) return 0;
+
+    if (idx >= 0) {
+        unindex_todo(idx);
+        index_todo(idx);
+        if (due_ready && todos[idx].due_date > 0) {
+            due_remove(todos[idx].due_date, idx);
+            due_insert(todos[idx].due_date, idx);
+        }
+        todos[idx].flags &= ~TODO_DELETED;
+        deleted_count--;
+        update_columns(idx);
+        count_todo(idx, 1);
+        view_update(idx);
+        if (todos[idx].text_len != entry->text_len || memcmp(todo_text(idx), text, entry->text_len)) {
+            store_set_text(idx, text, entry->text_len);
+        }
+    } else {
+        idx = store_add(text, entry->text_len, entry->uid, entry->created_at);
+    }
+
+    const Category *current = &categories[todos[idx].category_id];
+    if (current->name_len != entry->category_len ||
+        memcmp(category_name(todos[idx].category_id), category, entry->category_len)) {
+        store_set_category(idx, category, entry->category_len);
+    }
+    if (todos[idx].due_date != entry->due_date) store_set_due_date(idx, entry->due_date);
+    if (todos[idx].done != entry->done) store_set_done(idx, entry->done);
+    store_set_repeat(idx, entry->repeat);
+    return 1;
+}
+
+// Tombstones every done todo in one pass
+void store_purge_done() {
+    finish_index_build();
+    for (int i = 0; i < todo_count; i++) {
+        if (todos[i].done && !(todos[i].flags & TODO_DELETED)) {
+            count_todo(i, -1);
+            todos[i].flags |= TODO_DELETED;
+            deleted_count++;
+            update_columns(i);
+        }
+    }
+    unmark_deleted();
+    invalidate_view();
+}
+
+// Drops the marks of todos a batch deleted, as store_delete() does for one
+void unmark_deleted() {
+    int kept = 0;
+    for (int n = 0; n < marked.count; n++) {
+        if (!(todos[marked.items[n]].flags & TODO_DELETED)) marked.items[kept++] = marked.items[n];
+    }
+    marked.count = kept;
+}
+
+// Applies one change to every slot. Large batches stop maintaining the
+// index they affect row by row and leave it to be rebuilt on next use, so
+// the whole batch costs a single index update.
+void store_batch(int op, const int *slots, int count, int64_t value, const char *name, size_t len) {
+    finish_index_build();
+    int reindex = count >= BATCH_REINDEX_MIN;
+    if (reindex && op == OP_BATCH_CATEGORY) drop_trigram_index();
+    if (reindex && op == OP_BATCH_DUE) due_ready = 0;
+    if (reindex && op == OP_BATCH_CATEGORY) sort_ready[SORT_CATEGORY] = 0;
+
+    int category_id = op == OP_BATCH_CATEGORY ? intern_category(name, len) : CATEGORY_NONE;
+    for (int n = 0; n < count; n++) {
+        int idx = slots[n];
+        count_todo(idx, -1);
+        switch (op) {
+            case OP_BATCH_DELETE:
+                todos[idx].flags |= TODO_DELETED;
+                deleted_count++;
+                break;
+            case OP_BATCH_DONE:
+                todos[idx].done = value != 0;
+                break;
+            case OP_BATCH_DUE:
+                if (due_ready && todos[idx].due_date > 0) due_remove(todos[idx].due_date, idx);
+                if (due_ready && value > 0) due_insert(value, idx);
+                todos[idx].due_date = value;
+                break;
+            case OP_BATCH_CATEGORY:
+                unindex_todo(idx);
+                sort_remove(SORT_CATEGORY, idx);
+                todos[idx].category_id = category_id;
+                index_todo(idx);
+                sort_insert(SORT_CATEGORY, idx);
+                break;
+            case OP_BATCH_REPEAT:
+                store_set_repeat(idx, value);
+                break;
+        }
+        update_columns(idx);
+        count_todo(idx, 1);
+    }
+    if (op == OP_BATCH_DELETE) unmark_deleted();
+    invalidate_view();
+}
+
+// Drops the tombstones, moving the survivors down in order and renumbering
+// every index to match. Runs as part of compact_journal(), once the
+// snapshot that leaves them out is on its way to disk.
+void compact_store() {
+    finish_index_build();
+    if (deleted_count == 0) return;
+
+    int *remap = xrealloc(NULL, todo_count * sizeof(int));
+    int live = 0;
+    for (int i = 0; i < todo_count; i++) {
+        if (todos[i].flags & TODO_DELETED) {
+            remap[i] = -1;
+            continue;
+        }
+        if (live != i) todos[live] = todos[i];
+        if (live != i && text_keys_ready) text_keys[live] = text_keys[i];
+        remap[i] = live++;
+    }
+
+    if (view_streaming) {
+        invalidate_view(); // view_next would no longer fall on a chunk
+    } else if (!view_dirty) {
+        remap_list(&view, remap);
+    }
+    remap_list(&marked, remap);
+    for (int mode = SORT_CATEGORY; mode < SORT_MODES; mode++) {
+        if (sort_ready[mode]) remap_list(&sort_orders[mode], remap);
+    }
+    uid_ready = 0;
+    for (int b = 0; b < trigrams.buckets; b++) {
+        if (trigrams.entries[b].trigram != 0) remap_list(&trigrams.entries[b].todos, remap);
+    }
+
+    int kept = 0;
+    for (int n = 0; n < due_count; n++) {
+        int idx = remap[due_index[n].idx];
+        if (idx == -1) continue;
+        due_index[kept].due_date = due_index[n].due_date;
+        due_index[kept].idx = idx;
+        kept++;
+    }
+    due_count = kept;
+
+    todo_count = live;
+    deleted_count = 0;
+    columns_ready = 0;
+    free(remap);
+}
+
+// Renumbers list through remap, dropping entries that map to -1. remap is
+// increasing, so lists in slot order stay so, and ties in the other orders
+// stay in slot order.
+void remap_list(IndexList *list, const int *remap) {
+    int kept = 0;
+    for (int n = 0; n < list->count; n++) {
+        int idx = remap[list->items[n]];
+        if (idx != -1) list->items[kept++] = idx;
+    }
+    list->count = kept;
+}
+
+void store_set_done(int idx, int done) {
+    finish_index_build();
+    count_todo(idx, -1);
+    todos[idx].done = done;
+    update_columns(idx);
+    count_todo(idx, 1);
+    view_update(idx);
+}
+
+// The old string stays in the pool until the next save/load compacts it
+void store_set_text(int idx, const char *text, size_t len) {
+    finish_index_build();
+    unindex_todo(idx);
+    sort_remove(SORT_TEXT, idx);
+    todos[idx].text_off = pool_add(text, len);
+    todos[idx].text_len = len;
+    index_todo(idx);
+    sort_insert(SORT_TEXT, idx);
+    view_update(idx);
+}
+
+void store_set_due_date(int idx, time_t due_date) {
+    finish_index_build();
+    if (due_ready) {
+        if (todos[idx].due_date > 0) due_remove(todos[idx].due_date, idx);
+        if (due_date > 0) due_insert(due_date, idx);
+    }
+    count_todo(idx, -1);
+    todos[idx].due_date = due_date;
+    update_columns(idx);
+    count_todo(idx, 1);
+    view_update(idx);
+}
+
+void store_set_category(int idx, const char *name, size_t len) {
+    finish_index_build();
+    unindex_todo(idx);
+    sort_remove(SORT_CATEGORY, idx);
+    int category_id = intern_category(name, len);
+    count_todo(idx, -1);
+    todos[idx].category_id = category_id;
+    update_columns(idx);
+    count_todo(idx, 1);
+    index_todo(idx);
+    sort_insert(SORT_CATEGORY, idx);
+    view_update(idx);
+}
+
+// The rule is only read when a series is completed or drawn, so no index
+// or view depends on it. A monthly rule without a day of the month takes
+// the one the todo is due on, which later occurrences clamp from.
+void store_set_repeat(int idx, uint32_t repeat) {
+    if ((repeat & 3) == REPEAT_MONTHS && !(repeat >> REPEAT_DAY_SHIFT) && todos[idx].due_date > 0) {
+        struct tm tm;
+        time_t due_date = todos[idx].due_date;
+        localtime_r(&due_date, &tm);
+        repeat |= (uint32_t)tm.tm_mday << REPEAT_DAY_SHIFT;
+    }
+    todos[idx].flags = (todos[idx].flags & ((1u << REPEAT_SHIFT) - 1)) | repeat << REPEAT_SHIFT;
+}
+
+// Appends a blank todo, growing the array as needed
+Todo* new_todo() {
+    if (todo_count == todo_capacity) {
+        todo_capacity = todo_capacity ? todo_capacity * 2 : INITIAL_TODO_CAPACITY;
+        todos = grow_buffer(todos, todo_count * sizeof(Todo), todo_capacity * sizeof(Todo));
+    }
+
+    Todo *todo = &todos[todo_count++];
+    memset(todo, 0, sizeof(Todo));
+    return todo;
+}
+
+uint64_t next_uid() {
+    while (uid_nonce == 0) {
+        uint32_t nonce;
+        if (getrandom(&nonce, sizeof(nonce), 0) != sizeof(nonce)) nonce = getpid() ^ time(NULL);
+        uid_nonce = nonce;
+    }
+    return uid_nonce << 32 | ++uid_counter;
+}
+
+void build_uid_map() {
+    uid_buckets = INITIAL_UID_BUCKETS;
+    while (uid_buckets < todo_count * 2) uid_buckets *= 2;
+    uid_table = xrealloc(uid_table, uid_buckets * sizeof(int));
+    for (int b = 0; b < uid_buckets; b++) uid_table[b] = -1;
+
+    uid_ready = 1;
+    for (int i = 0; i < todo_count; i++) uid_insert(i);
+}
+
+void uid_insert(int idx) {
+    if (!uid_ready) return;
+    if (todo_count * 2 > uid_buckets) {
+        build_uid_map(); // Rehashes every slot, idx included
+        return;
+    }
+    uint32_t b = (uint32_t)((todos[idx].uid * 11400714819323198485ull) >> 32) & (uid_buckets - 1);
+    while (uid_table[b] != -1) b = (b + 1) & (uid_buckets - 1);
+    uid_table[b] = idx;
+}
+
+// Slot of the live todo with uid, or -1
+int find_todo(uint64_t uid) {
+    int idx = find_slot(uid);
+    return idx >= 0 && !(todos[idx].flags & TODO_DELETED) ? idx : -1;
+}
+
+// Slot holding uid, or -1. An undone delete that was compacted away
+// leaves the todo restored in a new slot, so a uid can also name
+// tombstones; the live slot wins.
+int find_slot(uint64_t uid) {
+    if (!uid_ready) build_uid_map();
+    uint32_t b = (uint32_t)((uid * 11400714819323198485ull) >> 32) & (uid_buckets - 1);
+    int found = -1;
+    for (; uid_table[b] != -1; b = (b + 1) & (uid_buckets - 1)) {
+        int idx = uid_table[b];
+        if (todos[idx].uid != uid) continue;
+        if (!(todos[idx].flags & TODO_DELETED)) return idx;
+        found = idx;
+    }
+    return found;
+}
+
+// FNV-1a over the case-folded bytes of key
+uint32_t hash_key(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)key[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Doubles the table until it is at most half full, then rehashes into it
+void grow_category_buckets() {
+    do {
+        bucket_count = bucket_count ? bucket_count * 2 : INITIAL_CATEGORY_CAPACITY * 2;
+    } while (category_count * 2 > bucket_count);
+    category_buckets = xrealloc(category_buckets, bucket_count * sizeof(int));
+    for (int i = 0; i < bucket_count; i++) category_buckets[i] = -1;
+
+    for (int id = 1; id < category_count; id++) {
+        uint32_t slot = categories[id].hash & (bucket_count - 1);
+        while (category_buckets[slot] != -1) slot = (slot + 1) & (bucket_count - 1);
+        category_buckets[slot] = id;
+    }
+}
+
+// Returns the id of the category named name (any case), or -1 if unknown
+int find_category(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0) return CATEGORY_NONE;
+
+    uint32_t hash = hash_key(name, len);
+    uint32_t slot = hash & (bucket_count - 1);
+    while (category_buckets[slot] != -1) {
+        Category *cat = &categories[category_buckets[slot]];
+        if (cat->hash == hash && cat->name_len == len &&
+            strncasecmp(string_pool + cat->key_off, name, len) == 0) {
+            return category_buckets[slot];
+        }
+        slot = (slot + 1) & (bucket_count - 1);
+    }
+    return -1;
+}
+
+// Returns the id for name, adding it to the table on first use
+int intern_category(const char *name, size_t len) {
+    char key[UINT16_MAX + 1];
+    memcpy(key, name, len);
+    key[len] = '\0';
+
+    int id = find_category(key);
+    if (id != -1) return id;
+
+    if (category_count > UINT16_MAX) return CATEGORY_NONE;
+    if (category_count == category_capacity) {
+        category_capacity *= 2;
+        categories = grow_buffer(categories, category_count * sizeof(Category),
+                                 category_capacity * sizeof(Category));
+    }
+    if ((category_count + 1) * 2 > bucket_count) grow_category_buckets();
+
+    for (size_t i = 0; i < len; i++) key[i] = tolower((unsigned char)key[i]);
+
+    id = category_count++;
+    Category *cat = &categories[id];
+    cat->name_off = pool_add(name, len);
+    cat->key_off = pool_add(key, len);
+    cat->name_len = len;
+    cat->hash = hash_key(key, len);
+
+    uint32_t slot = cat->hash & (bucket_count - 1);
+    while (category_buckets[slot] != -1) slot = (slot + 1) & (bucket_count - 1);
+    category_buckets[slot] = id;
+    return id;
+}
+
+const char* category_name(int id) {
+    return string_pool + categories[id].name_off;
+}
+
+// Writes the data file as a StoreHeader followed by the record table, the
+// category table, the string heap and the archive table. Strings are repacked into the heap in
+// order, so stale pool entries left behind by edits are dropped here, and
+// so are tombstones. The file is written aside and renamed into place; a
+// live mapping of the old file stays valid.
+int save_todos(const StoreImage *image) {
+    // Heap layout: the shared empty string, category names and keys, texts
+    uint64_t heap_size = 1;
+    int records = 0;
+    for (int id = 0; id < image->category_count; id++) {
+        if (image->categories[id].name_len) heap_size += 2 * (image->categories[id].name_len + 1);
+    }
+    for (int i = 0; i < image->todo_count; i++) {
+        if (image->todos[i].flags & TODO_DELETED) continue;
+        if (image->todos[i].text_len) heap_size += image->todos[i].text_len + 1;
+        records++;
+    }
+    if (heap_size > UINT32_MAX) return 0;
+
+    StoreHeader header = {0};
+    header.magic = STORE_MAGIC;
+    header.version = STORE_VERSION;
+    header.header_size = sizeof(StoreHeader);
+    header.byte_order = STORE_BYTE_ORDER;
+    header.record_size = sizeof(Todo);
+    header.category_size = sizeof(Category);
+    header.generation = image->generation;
+    header.record_count = records;
+    header.records_offset = sizeof(StoreHeader);
+    header.category_count = image->category_count;
+    header.categories_offset = header.records_offset + (uint64_t)records * sizeof(Todo);
+    header.heap_offset = header.categories_offset + image->category_count * sizeof(Category);
+    header.heap_size = heap_size;
+    header.archive_count = image->archive_count;
+    header.archive_offset = (header.heap_offset + heap_size + 7) & ~(uint64_t)7;
+    header.checksum = checksum(&header, offsetof(StoreHeader, checksum), 2166136261u);
+
+    FILE *file = fopen(DATA_FILE ".tmp", "wb");
+    if (!file) return 0;
+    fwrite(&header, sizeof(StoreHeader), 1, file);
+
+    uint32_t next = 1;
+    for (int id = 0; id < image->category_count; id++) {
+        next += image->categories[id].name_len ? 2 * (image->categories[id].name_len + 1) : 0;
+    }
+    for (int i = 0; i < image->todo_count; i++) {
+        if (image->todos[i].flags & TODO_DELETED) continue;
+        Todo record = image->todos[i];
+        record.text_off = record.text_len ? next : 0;
+        next += record.text_len ? record.text_len + 1 : 0;
+        fwrite(&record, sizeof(Todo), 1, file);
+    }
+
+    next = 1;
+    for (int id = 0; id < image->category_count; id++) {
+        Category record = image->categories[id];
+        if (record.name_len) {
+            record.name_off = next;
+            record.key_off = next + record.name_len + 1;
+            next += 2 * (record.name_len + 1);
+        }
+        fwrite(&record, sizeof(Category), 1, file);
+    }
+
+    fputc('\0', file);
+    for (int id = 0; id < image->category_count; id++) {
+        if (!image->categories[id].name_len) continue;
+        fwrite(image->pool + image->categories[id].name_off, 1, image->categories[id].name_len + 1, file);
+        fwrite(image->pool + image->categories[id].key_off, 1, image->categories[id].name_len + 1, file);
+    }
+    for (int i = 0; i < image->todo_count; i++) {
+        const Todo *todo = &image->todos[i];
+        if (todo->text_len && !(todo->flags & TODO_DELETED)) fwrite(image->pool + todo->text_off, 1, todo->text_len + 1, file);
+    }
+    static const char padding[8];
+    fwrite(padding, 1, header.archive_offset - header.heap_offset - heap_size, file);
+    if (image->archive_count) fwrite(image->archive, sizeof(ArchiveRef), image->archive_count, file);
+
+    int ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    PROFILE_COUNT(profile_bytes, header.archive_offset + image->archive_count * sizeof(ArchiveRef));
+    return ok && rename(DATA_FILE ".tmp", DATA_FILE) == 0;
+}
+
+StoreImage live_image() {
+    StoreImage image = {todos, todo_count, categories, category_count, string_pool, pool_size,
+                        archive, archive_count, store_generation, foreign_applied};
+    return image;
+}
+
+// Copies the live store into one allocation the persister can save while
+// the UI thread keeps editing; a memcpy per array is the only cost here
+StoreImage* snapshot_store() {
+    size_t todos_size = todo_count * sizeof(Todo);
+    size_t categories_size = category_count * sizeof(Category);
+    size_t archive_size = archive_count * sizeof(ArchiveRef);
+    StoreImage *image = xrealloc(NULL, sizeof(StoreImage) + archive_size + todos_size +
+                                       categories_size + pool_size);
+    char *data = (char *)(image + 1);
+
+    *image = live_image();
+    image->archive = archive_size ? memcpy(data, archive, archive_size) : NULL;
+    data += archive_size;
+    image->todos = memcpy(data, todos, todos_size);
+    image->categories = memcpy(data + todos_size, categories, categories_size);
+    image->pool = memcpy(data + todos_size + categories_size, string_pool, pool_size);
+    return image;
+}
+
+// Files from the fixed-array version hold exactly count raw LegacyTodo structs
+int load_legacy_todos(FILE *file, long start, int count) {
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    if (count < 0 || size != (long)(start + count * sizeof(LegacyTodo))) {
+        return 0;
+    }
+
+    fseek(file, start, SEEK_SET);
+    LegacyTodo legacy;
+    for (int i = 0; i < count; i++) {
+        if (fread(&legacy, sizeof(LegacyTodo), 1, file) != 1) break;
+        legacy.text[MAX_LENGTH - 1] = '\0';
+        legacy.category[MAX_LENGTH - 1] = '\0';
+
+        Todo *todo = new_todo();
+        todo->text_len = strlen(legacy.text);
+        todo->text_off = pool_add(legacy.text, todo->text_len);
+        todo->category_id = intern_category(legacy.category, strlen(legacy.category));
+        todo->due_date = legacy.due_date;
+        todo->done = legacy.done;
+    }
+    return 1;
+}
+
+// Maps a version 1 data file. Files from older versions are parsed and
+// rewritten in the new format by the next snapshot. A file that fails
+// validation is never overwritten: we refuse to start instead.
+void load_todos() {
+    int fd = open(DATA_FILE, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    uint32_t magic = 0;
+    if (fstat(fd, &st) == 0 && pread(fd, &magic, sizeof(uint32_t), 0) == sizeof(uint32_t) &&
+        magic == STORE_MAGIC) {
+        int ok = map_store(fd, st.st_size);
+        close(fd);
+        if (!ok) {
+            endwin();
+            fprintf(stderr, "minimal-todo: %s is corrupt or from an unsupported version\n", DATA_FILE);
+            exit(1);
+        }
+        return;
+    }
+
+    FILE *file = fdopen(fd, "rb");
+    if (file) {
+        load_stream_todos(file);
         fclose(file);
+    } else {
+        close(fd);
+    }
+    for (int i = 0; i < todo_count; i++) todos[i].uid = i + 1;
+}
+
+// Loads the snapshot and replays the journal while holding the journal
+// lock, so another instance cannot fold the journal into a new snapshot in
+// between. The caller releases the lock once it no longer needs a stable
+// journal.
+void open_store() {
+    journal = fopen(JOURNAL_FILE, "r+b");
+    if (!journal) journal = fopen(JOURNAL_FILE, "w+b");
+    if (journal) flock(fileno(journal), LOCK_EX);
+
+    load_todos();
+    if (journal) open_journal();
+}
+
+// Drops the whole in-memory store, ready for open_store() to load it again
+void reset_store() {
+    finish_index_build();
+    if (journal) fclose(journal);
+    journal = NULL;
+
+    int mapped_todos = map_base && (char *)todos >= map_base && (char *)todos < map_base + map_size;
+    int mapped_categories = map_base && (char *)categories >= map_base &&
+                            (char *)categories < map_base + map_size;
+    int mapped_pool = map_base && string_pool >= map_base && string_pool < map_base + map_size;
+    if (!mapped_todos) free(todos);
+    if (!mapped_categories) free(categories);
+    if (!mapped_pool) free(string_pool);
+    if (map_base) munmap(map_base, map_size);
+    map_base = NULL;
+    map_size = 0;
+
+    todos = NULL;
+    todo_count = todo_capacity = deleted_count = 0;
+    bucket_count = 0;
+    if (trigrams.entries) drop_trigram_index();
+    trigram_ready = 0;
+    due_ready = 0;
+    columns_ready = 0;
+    counters_ready = 0;
+    drop_sort_orders();
+    category_key_count = 0;
+    uid_ready = 0;
+    marked.count = 0;
+    journal_records = 0;
+    archive_count = 0;
+    archived_todos = 0;
+    if (archive_fd >= 0) close(archive_fd);
+    archive_fd = -1;
+    invalidate_view();
+    init_store();
+}
+
+// Another instance folded the journal into a new snapshot, which holds
+// every record this one has seen: start over from it. The persister is
+// drained first, so the reloaded journal also holds our own last records.
+void reload_store() {
+    stop_persister();
+    pthread_mutex_lock(&inbox_lock);
+    inbox_size = 0;
+    inbox_reload = 0;
+    foreign_forwarded = foreign_applied = 0;
+    pthread_mutex_unlock(&inbox_lock);
+
+    reset_store();
+    open_store();
+    if (journal) flock(fileno(journal), LOCK_UN);
+    start_index_build();
+    start_persister();
+}
+
+// The arrays are used in place, without parsing or copying them. Startup
+// still reads the record and category tables once, sequentially, to check
+// their offsets and ids, so it faults in those tables but none of the
+// string heap. The mapping is private, so edits and replayed journal records
+// copy only the pages they touch, and nothing is ever written back to the
+// file.
+int map_store(int fd, size_t size) {
+    if (size < sizeof(StoreHeaderV3)) return 0;
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) return 0;
+
+    StoreHeader *header = (StoreHeader *)base;
+    if (!valid_store(header, size)) {
+        munmap(base, size);
+        return 0;
+    }
+
+    // Records before version 3 are widened into a heap table; version 3
+    // records are already laid out as now and only lack the archive table
+    Todo *records = (Todo *)(base + header->records_offset);
+    int widened = header->version <= 2;
+    if (widened) {
+        const TodoV1 *v1 = (const TodoV1 *)records;
+        const TodoV2 *v2 = (const TodoV2 *)records;
+        records = xrealloc(NULL, (header->record_count ? header->record_count : 1) * sizeof(Todo));
+        for (uint64_t i = 0; i < header->record_count; i++) {
+            Todo todo = header->version == 1
+                ? (Todo){v1[i].due_date, i + 1, 0, v1[i].text_off, v1[i].text_len,
+                         v1[i].category_id, v1[i].done, v1[i].flags}
+                : (Todo){v2[i].due_date, v2[i].uid, 0, v2[i].text_off, v2[i].text_len,
+                         v2[i].category_id, v2[i].done, v2[i].flags};
+            records[i] = todo;
+        }
+    }
+    if (!valid_records(records, header)) {
+        if (widened) free(records);
+        munmap(base, size);
+        return 0;
+    }
+
+    free(todos);
+    free(categories);
+    free(string_pool);
+    map_base = base;
+    map_size = size;
+
+    todos = records;
+    todo_count = todo_capacity = header->record_count;
+    categories = (Category *)(base + header->categories_offset);
+    category_count = category_capacity = header->category_count;
+    string_pool = base + header->heap_offset;
+    pool_size = pool_capacity = header->heap_size;
+    store_generation = header->generation;
+
+    archive_count = header->version < 4 ? 0 : header->archive_count;
+    if (archive_count > archive_capacity) {
+        archive_capacity = archive_count;
+        archive = xrealloc(archive, archive_capacity * sizeof(ArchiveRef));
+    }
+    if (archive_count) memcpy(archive, base + header->archive_offset, archive_count * sizeof(ArchiveRef));
+    archived_todos = 0;
+    for (int n = 0; n < archive_count; n++) archived_todos += archive[n].block.count;
+
+    bucket_count = 0;
+    grow_category_buckets();
+    return 1;
+}
+
+// Checks that every table lies inside the file and every offset and id in
+// them stays inside its table; valid_records() checks the record table.
+// Strings are not read: the heap ends with a NUL, so even a wrong length
+// cannot run past it.
+int valid_store(const StoreHeader *header, size_t size) {
+    size_t record_size = header->version == 1 ? sizeof(TodoV1)
+                       : header->version == 2 ? sizeof(TodoV2) : sizeof(Todo);
+    // Both layouts end with the checksum and its padding
+    int archived = header->version >= 4;
+    size_t header_size = archived ? sizeof(StoreHeader) : sizeof(StoreHeaderV3);
+    if (size < header_size) return 0;
+    size_t checked = header_size - 2 * sizeof(uint32_t);
+    uint32_t stored;
+    memcpy(&stored, (const char *)header + checked, sizeof(uint32_t));
+    if (header->magic != STORE_MAGIC || header->version < 1 || header->version > STORE_VERSION ||
+        header->header_size != header_size || header->byte_order != STORE_BYTE_ORDER ||
+        header->record_size != record_size || header->category_size != sizeof(Category) ||
+        stored != checksum(header, checked, 2166136261u)) {
+        return 0;
+    }
+    if (archived && (header->archive_offset % sizeof(int64_t) != 0 || header->archive_offset > size ||
+                     header->archive_count > INT32_MAX ||
+                     header->archive_count > (size - header->archive_offset) / sizeof(ArchiveRef))) {
+        return 0;
+    }
+
+    if (header->records_offset % sizeof(int64_t) != 0 ||
+        header->categories_offset % sizeof(uint32_t) != 0 ||
+        header->records_offset > size || header->categories_offset > size ||
+        header->heap_offset > size ||
+        header->record_count > INT32_MAX ||
+        header->record_count > (size - header->records_offset) / record_size ||
+        header->category_count < 1 || header->category_count > UINT16_MAX + 1 ||
+        header->category_count > (size - header->categories_offset) / sizeof(Category) ||
+        header->heap_size < 1 || header->heap_size > UINT32_MAX ||
+        header->heap_size > size - header->heap_offset) {
+        return 0;
+    }
+
+    const char *base = (const char *)header;
+    const char *heap = base + header->heap_offset;
+    if (heap[0] != '\0' || heap[header->heap_size - 1] != '\0') return 0;
+
+    const Category *cats = (const Category *)(base + header->categories_offset);
+    for (uint64_t id = 0; id < header->category_count; id++) {
+        if ((uint64_t)cats[id].name_off + cats[id].name_len >= header->heap_size ||
+            (uint64_t)cats[id].key_off + cats[id].name_len >= header->heap_size) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int valid_records(const Todo *records, const StoreHeader *header) {
+    for (uint64_t i = 0; i < header->record_count; i++) {
+        if ((uint64_t)records[i].text_off + records[i].text_len >= header->heap_size ||
+            records[i].category_id >= header->category_count) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Reads the length-prefixed layout used before version 1, with or without
+// its generation header, or the raw structs of the fixed-array version
+void load_stream_todos(FILE *file) {
+    uint32_t magic = 0, pad;
+    long start = 0;
+    if (fread(&magic, sizeof(uint32_t), 1, file) == 1 && magic == STREAM_MAGIC &&
+        fread(&pad, sizeof(uint32_t), 1, file) == 1 &&
+        fread(&store_generation, sizeof(uint64_t), 1, file) == 1) {
+        start = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    }
+    fseek(file, start, SEEK_SET);
+
+    int count = 0;
+    if (fread(&count, sizeof(int), 1, file) != 1 ||
+        load_legacy_todos(file, start + sizeof(int), count)) {
+        return;
+    }
+
+    fseek(file, start + sizeof(int), SEEK_SET);
+    char buffer[UINT16_MAX + 1];
+    for (int i = 0; i < count; i++) {
+        time_t due_date;
+        int done;
+        uint16_t text_len, category_len;
+
+        if (fread(&due_date, sizeof(time_t), 1, file) != 1 ||
+            fread(&done, sizeof(int), 1, file) != 1 ||
+            fread(&text_len, sizeof(uint16_t), 1, file) != 1 ||
+            fread(buffer, 1, text_len, file) != text_len) break;
+        uint32_t text_off = pool_add(buffer, text_len);
+
+        if (fread(&category_len, sizeof(uint16_t), 1, file) != 1 ||
+            fread(buffer, 1, category_len, file) != category_len) break;
+
+        Todo *todo = new_todo();
+        todo->text_off = text_off;
+        todo->text_len = text_len;
+        todo->category_id = intern_category(buffer, category_len);
+        todo->due_date = due_date;
+        todo->done = done;
+    }
+}
+
+// FNV-1a, chained through hash so a record can be checksummed in pieces
+uint32_t checksum(const void *data, size_t len, uint32_t hash) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint32_t record_checksum(const JournalRecord *rec, const char *payload) {
+    uint32_t hash = checksum(&rec->length, sizeof(rec->length), 2166136261u);
+    hash = checksum(&rec->value, sizeof(JournalRecord) - offsetof(JournalRecord, value), hash);
+    return checksum(payload, rec->length, hash);
+}
+
+// Reads one record and its payload, converting a version 0 record, which
+// named its todo by slot, to name it by uid. Returns 0 at the end of the
+// journal or at a torn record.
+int read_record(FILE *file, int version, JournalRecord *rec, char **payload, size_t *capacity) {
+    JournalRecordV0 old;
+    if (version == 0) {
+        if (fread(&old, sizeof(JournalRecordV0), 1, file) != 1) return 0;
+        rec->length = old.length;
+    } else if (fread(rec, sizeof(JournalRecord), 1, file) != 1) {
+        return 0;
+    }
+    if (rec->length > JOURNAL_MAX_PAYLOAD) return 0;
+    // Widening version 0 batch slots to uids doubles their size
+    size_t needed = 2 * (size_t)rec->length + 1;
+    if (needed > *capacity) {
+        *capacity = needed;
+        *payload = xrealloc(*payload, *capacity);
+    }
+    if (fread(*payload, 1, rec->length, file) != rec->length) return 0;
+    if (version != 0) return rec->checksum == record_checksum(rec, *payload);
+
+    uint32_t hash = checksum(&old.length, sizeof(old.length), 2166136261u);
+    hash = checksum(&old.value, sizeof(JournalRecordV0) - offsetof(JournalRecordV0, value), hash);
+    if (old.checksum != checksum(*payload, old.length, hash)) return 0;
+
+    memset(rec, 0, sizeof(JournalRecord));
+    rec->length = old.length;
+    rec->value = old.value;
+    rec->op = old.op;
+    if (old.op >= OP_BATCH_DELETE && old.op <= OP_BATCH_CATEGORY) {
+        if (old.idx < 0 || (uint64_t)old.idx * sizeof(int32_t) > old.length) return 0;
+        size_t slots_len = old.idx * sizeof(int32_t);
+        size_t uids_len = old.idx * sizeof(uint64_t);
+        memmove(*payload + uids_len, *payload + slots_len, old.length - slots_len);
+        for (int n = old.idx - 1; n >= 0; n--) {
+            int32_t slot;
+            memcpy(&slot, *payload + n * sizeof(int32_t), sizeof(int32_t));
+            uint64_t uid = slot >= 0 && slot < todo_count ? todos[slot].uid : 0;
+            memcpy(*payload + n * sizeof(uint64_t), &uid, sizeof(uint64_t));
+        }
+        rec->uid = old.idx;
+        rec->length = old.length - slots_len + uids_len;
+    } else if (old.op == OP_ADD) {
+        rec->uid = (uint64_t)old.idx + 1;
+    } else {
+        rec->uid = old.idx >= 0 && old.idx < todo_count ? todos[old.idx].uid : 0;
+    }
+    return 1;
+}
+
+// Replays the records written since the snapshot that load_todos() read.
+// A journal from another generation was already folded into the snapshot
+// and is discarded. Replay stops at the first torn record, and the file is
+// cut there so new records follow the last good one. A version 0 journal is
+// folded into a snapshot straight away, so that only uids are appended.
+// Called with the journal locked.
+void open_journal() {
+    JournalHeader header;
+    if (fread(&header, sizeof(JournalHeader), 1, journal) != 1 ||
+        header.magic != JOURNAL_MAGIC || header.version > JOURNAL_VERSION ||
+        header.generation != store_generation) {
+        reset_journal(store_generation);
+        return;
+    }
+
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    long end = sizeof(JournalHeader);
+    JournalRecord rec;
+    while (read_record(journal, header.version, &rec, &payload, &payload_capacity)) {
+        replay_record(&rec, payload);
+        journal_records++;
+        end = ftell(journal);
+    }
+    free(payload);
+
+    fflush(journal);
+    if (header.version < JOURNAL_VERSION || ftruncate(fileno(journal), end) != 0) {
+        compact_journal();
+        return;
+    }
+    fseek(journal, end, SEEK_SET);
+}
+
+// Restores the todos of a restore record's payload; returns how many came
+// back. A todo whose slot the store still has is revived there if revive
+// is set and left as it is otherwise. As in store_batch(), a large batch
+// leaves the indexes to be rebuilt.
+int restore_entries(const char *payload, size_t length, uint64_t count, int revive) {
+    invalidate_view();
+    if (count >= BATCH_REINDEX_MIN) {
+        drop_trigram_index();
+        due_ready = 0;
+        drop_sort_orders();
+    }
+    int restored = 0;
+    size_t pos = 0;
+    for (uint64_t n = 0; n < count && pos + sizeof(RestoreEntry) <= length; n++) {
+        RestoreEntry entry;
+        memcpy(&entry, payload + pos, sizeof(RestoreEntry));
+        pos += sizeof(RestoreEntry);
+        if (pos + entry.text_len + entry.category_len > length) break;
+        if (revive || find_slot(entry.uid) < 0) {
+            restored += store_restore(&entry, payload + pos, payload + pos + entry.text_len);
+        }
+        pos += entry.text_len + entry.category_len;
+    }
+    return restored;
+}
+
+// Applies one record. Returns 0 if it no longer applies, because another
+// instance deleted its todo first; such records are skipped.
+int replay_record(const JournalRecord *rec, const char *payload) {
+    if (rec->op == OP_ADD) {
+        if (find_todo(rec->uid) >= 0) return 0;
+        store_add(payload, rec->length, rec->uid, rec->value);
+        return 1;
+    }
+
+    if (rec->op == OP_PURGE_DONE) {
+        store_purge_done();
+        return 1;
+    }
+
+    if (rec->op == OP_BATCH_RESTORE) return restore_entries(payload, rec->length, rec->uid, 1) > 0;
+
+    if (rec->op == OP_THAW) {
+        for (int n = 0; n < archive_count; n++) {
+            if (archive[n].block.id == (uint64_t)rec->value) return thaw_block(n);
+        }
+        return 0;
+    }
+
+    if ((rec->op >= OP_BATCH_DELETE && rec->op <= OP_BATCH_CATEGORY) || rec->op == OP_BATCH_REPEAT) {
+        static int *slots = NULL;
+        static int capacity = 0;
+        uint64_t count = rec->uid;
+        if (count > rec->length / sizeof(uint64_t)) return 0;
+        if ((int)count > capacity) {
+            capacity = count;
+            slots = xrealloc(slots, capacity * sizeof(int));
+        }
+
+        int live = 0;
+        for (uint64_t n = 0; n < count; n++) {
+            uint64_t uid;
+            memcpy(&uid, payload + n * sizeof(uint64_t), sizeof(uint64_t));
+            int idx = find_todo(uid);
+            if (idx >= 0) slots[live++] = idx;
+        }
+        size_t uids_len = count * sizeof(uint64_t);
+        if (live > 0) {
+            store_batch(rec->op, slots, live, rec->value, payload + uids_len, rec->length - uids_len);
+        }
+        return live > 0;
+    }
+
+    int idx = find_todo(rec->uid);
+    if (idx < 0) return 0;
+    switch (rec->op) {
+        case OP_DELETE:   store_delete(idx); break;
+        case OP_DONE:     store_set_done(idx, rec->value != 0); break;
+        case OP_TEXT:     store_set_text(idx, payload, rec->length); break;
+        case OP_DUE:      store_set_due_date(idx, rec->value); break;
+        case OP_CATEGORY: store_set_category(idx, payload, rec->length); break;
+        case OP_REPEAT:   store_set_repeat(idx, rec->value); break;
+        default: return 0;
+    }
+    return 1;
+}
+
+// Empties the journal and stamps it with the generation of its snapshot
+void reset_journal(uint64_t generation) {
+    JournalHeader header = { JOURNAL_MAGIC, JOURNAL_VERSION, generation };
+
+    fflush(journal);
+    if (ftruncate(fileno(journal), 0) != 0) return;
+    rewind(journal);
+    fwrite(&header, sizeof(JournalHeader), 1, journal);
+    journal_unsynced = 1;
+    sync_journal();
+}
+
+void sync_journal() {
+    if (!journal || journal_unsynced == 0) return;
+    fflush(journal);
+    fsync(fileno(journal));
+    journal_unsynced = 0;
+}
+
+// With the persister running, records are queued for it and written within
+// moments. Otherwise each record is flushed to the kernel at once, so it
+// survives a crash of the app, and fsyncs are batched every
+// JOURNAL_SYNC_BATCH records.
+void journal_write(int op, int idx, int64_t value, const char *data, size_t len) {
+    journal_append(op, todos[idx].uid, value, data, len);
+}
+
+void journal_append(int op, uint64_t uid, int64_t value, const char *data, size_t len) {
+    if (!journal) return;
+
+    JournalRecord rec = {0};
+    rec.length = len;
+    rec.value = value;
+    rec.uid = uid;
+    rec.op = op;
+    rec.checksum = record_checksum(&rec, data);
+
+    if (persist_running) {
+        persist_push(&rec, data);
+    } else {
+        fwrite(&rec, sizeof(JournalRecord), 1, journal);
+        if (len) fwrite(data, 1, len, journal);
+        fflush(journal);
+        if (++journal_unsynced >= JOURNAL_SYNC_BATCH) sync_journal();
+    }
+
+    journal_records++;
+    if (journal_records >= JOURNAL_COMPACT_RECORDS ||
+        (deleted_count >= COMPACT_MIN_DELETED && deleted_count * 2 >= todo_count)) {
+        compact_journal();
+    }
+}
+
+// Writes a batch as records of the count in the uid field, then a payload
+// of the todos' uids followed by name. A batch too large for one record is
+// split; every op applies to each uid on its own, so replaying the parts in
+// turn has the same effect.
+void journal_write_batch(int op, const int *slots, int count, int64_t value,
+                         const char *name, size_t len) {
+    static char *payload = NULL;
+    static size_t capacity = 0;
+
+    int per_record = (int)((JOURNAL_MAX_PAYLOAD - len) / sizeof(uint64_t));
+    for (int first = 0; first < count; first += per_record) {
+        int part = count - first < per_record ? count - first : per_record;
+        size_t size = part * sizeof(uint64_t) + len;
+        if (size > capacity) {
+            capacity = size;
+            payload = xrealloc(payload, capacity);
+        }
+        for (int n = 0; n < part; n++) {
+            memcpy(payload + n * sizeof(uint64_t), &todos[slots[first + n]].uid, sizeof(uint64_t));
+        }
+        if (len) memcpy(payload + part * sizeof(uint64_t), name, len);
+        journal_append(op, part, value, payload, size);
+    }
+}
+
+// Folds the journal and the tombstones into a new snapshot. The snapshot
+// carries the next generation, so if we crash before the journal is reset
+// the stale records are recognized and skipped instead of being applied twice.
+// With the persister running, the UI thread only copies the store and queues
+// the copy behind the records it has already queued. The tombstones are only
+// dropped from memory once the snapshot is saved or queued: if the save
+// fails, the journal keeps every record and they still apply to the store.
+// Returns 0 if the snapshot could not be saved.
+int compact_journal() {
+    if (persist_running) {
+        StoreImage *image = snapshot_store();
+        JournalRecord rec = {0};
+        rec.op = PERSIST_SNAPSHOT;
+        rec.length = sizeof(StoreImage *);
+        persist_push(&rec, &image);
+        compact_store();
+        journal_records = 0;
+        return 1;
+    }
+
+    sync_journal();
+    store_generation++;
+    StoreImage image = live_image();
+    if (!save_todos(&image)) {
+        store_generation--;
+        return 0;
+    }
+    compact_store();
+    journal_records = 0;
+    if (journal) reset_journal(store_generation);
+    return 1;
+}
+
+void close_journal() {
+    compact_journal();
+    stop_persister();
+    if (journal) fclose(journal);
+    journal = NULL;
+}
+
+// Moves the done, non-repeating todos whose creation and due date are both
+// more than ARCHIVE_AGE_DAYS old into new archive blocks and folds the
+// change into a snapshot. Completion and edit times are not recorded, so a
+// todo done yesterday is archived as soon as it is old enough by those. They are sorted by
+// due date first, so each block covers a narrow range. Runs as a session
+// starts, while open_store() still holds the journal lock, so no other
+// instance sees the store in between. Blocks dropped from the table by
+// thaws are reclaimed here too, once they outweigh the live ones.
+void archive_done_todos() {
+    static IndexList frozen;
+    time_t cutoff = time(NULL) - (time_t)ARCHIVE_AGE_DAYS * DAY_SECONDS;
+    frozen.count = 0;
+    for (int i = 0; i < todo_count; i++) {
+        const Todo *todo = &todos[i];
+        if (todo->done && !(todo->flags & TODO_DELETED) && !todo_repeat(i) &&
+            todo->created_at < cutoff && todo->due_date < cutoff) {
+            list_push(&frozen, i);
+        }
+    }
+
+    uint64_t live_bytes = 0;
+    for (int n = 0; n < archive_count; n++) {
+        live_bytes += sizeof(ArchiveBlock) + archive[n].block.packed_size;
+    }
+    struct stat st;
+    int collect = stat(ARCHIVE_FILE, &st) == 0 && (uint64_t)st.st_size > 2 * live_bytes + ARCHIVE_SLACK;
+    if (frozen.count < ARCHIVE_MIN_TODOS) frozen.count = 0;
+    if (frozen.count == 0 && !collect) return;
+    if ((collect && !rewrite_archive()) || !open_archive()) return;
+
+    qsort(frozen.items, frozen.count, sizeof(int), compare_due_slots);
+    int kept = archive_count, archived = 0;
+    while (archived < frozen.count) {
+        int count = frozen.count - archived < ARCHIVE_BLOCK_TODOS ? frozen.count - archived
+                                                                  : ARCHIVE_BLOCK_TODOS;
+        if (!append_archive_block(frozen.items + archived, count)) break;
+        archived += count;
+    }
+    if (archived > 0 && fsync(archive_fd) != 0) {
+        while (archive_count > kept) archived_todos -= archive[--archive_count].block.count;
+        archived = 0;
+    }
+    if (archived > 0) store_batch(OP_BATCH_DELETE, frozen.items, archived, 0, NULL, 0);
+    compact_journal();
+}
+
+// Undated todos last, as in the due index
+int compare_due_slots(const void *a, const void *b) {
+    const Todo *x = &todos[*(const int *)a], *y = &todos[*(const int *)b];
+    int64_t x_due = x->due_date > 0 ? x->due_date : INT64_MAX;
+    int64_t y_due = y->due_date > 0 ? y->due_date : INT64_MAX;
+    if (x_due != y_due) return x_due < y_due ? -1 : 1;
+    return *(const int *)a - *(const int *)b;
+}
+
+// Compresses the todos into a block at the end of the archive file and adds
+// it to the archive table; the caller fsyncs the file
+int append_archive_block(const int *slots, int count) {
+    static char *raw = NULL, *packed = NULL;
+    static size_t raw_capacity = 0, packed_capacity = 0;
+    size_t raw_size = pack_todos(slots, count, &raw, &raw_capacity);
+    uLongf packed_size = compressBound(raw_size);
+    if (sizeof(ArchiveBlock) + packed_size > packed_capacity) {
+        packed_capacity = sizeof(ArchiveBlock) + packed_size;
+        packed = xrealloc(packed, packed_capacity);
+    }
+    if (compress2((Bytef *)packed + sizeof(ArchiveBlock), &packed_size, (const Bytef *)raw, raw_size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return 0;
+    }
+
+    ArchiveBlock block = {0};
+    block.magic = ARCHIVE_MAGIC;
+    block.id = next_uid();
+    block.due_min = INT64_MAX;
+    block.due_max = INT64_MIN;
+    for (int n = 0; n < count; n++) {
+        const Todo *todo = &todos[slots[n]];
+        block.bloom |= category_bloom(todo_category(slots[n]), categories[todo->category_id].name_len);
+        if (todo->due_date <= 0) {
+            block.undated++;
+            continue;
+        }
+        if (todo->due_date < block.due_min) block.due_min = todo->due_date;
+        if (todo->due_date > block.due_max) block.due_max = todo->due_date;
+    }
+    block.count = count;
+    block.raw_size = raw_size;
+    block.packed_size = packed_size;
+    block.checksum = block_checksum(&block, packed + sizeof(ArchiveBlock));
+    memcpy(packed, &block, sizeof(ArchiveBlock));
+
+    size_t size = sizeof(ArchiveBlock) + packed_size;
+    off_t offset = lseek(archive_fd, 0, SEEK_END);
+    if (offset < 0 || pwrite(archive_fd, packed, size, offset) != (ssize_t)size) return 0;
+
+    if (archive_count == archive_capacity) {
+        archive_capacity = archive_capacity ? archive_capacity * 2 : 64;
+        archive = xrealloc(archive, archive_capacity * sizeof(ArchiveRef));
+    }
+    archive[archive_count].block = block;
+    archive[archive_count].offset = offset;
+    archive_count++;
+    archived_todos += count;
+    PROFILE_COUNT(profile_bytes, size);
+    return 1;
+}
+
+uint32_t block_checksum(const ArchiveBlock *block, const char *payload) {
+    uint32_t hash = checksum(&block->id, sizeof(ArchiveBlock) - offsetof(ArchiveBlock, id), 2166136261u);
+    return checksum(payload, block->packed_size, hash);
+}
+
+uint64_t category_bloom(const char *name, size_t len) {
+    uint32_t hash = hash_key(name, len);
+    return 1ull << (hash & 63) | 1ull << (hash >> 6 & 63);
+}
+
+int open_archive() {
+    if (archive_fd < 0) archive_fd = open(ARCHIVE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    return archive_fd >= 0;
+}
+
+// Reads a block's header and compressed payload into *data. A rewrite of
+// the archive that no snapshot recorded yet leaves the table pointing at
+// old offsets, so a block not found there is looked up by its id.
+int load_archive_block(const ArchiveRef *ref, char **data, size_t *capacity) {
+    if (!open_archive()) return 0;
+
+    ArchiveBlock block;
+    uint64_t offset = ref->offset;
+    if (pread(archive_fd, &block, sizeof(ArchiveBlock), offset) != sizeof(ArchiveBlock) ||
+        block.magic != ARCHIVE_MAGIC || block.id != ref->block.id) {
+        for (offset = 0;; offset += sizeof(ArchiveBlock) + block.packed_size) {
+            if (pread(archive_fd, &block, sizeof(ArchiveBlock), offset) != sizeof(ArchiveBlock) ||
+                block.magic != ARCHIVE_MAGIC) {
+                return 0;
+            }
+            if (block.id == ref->block.id) break;
+        }
+    }
+
+    size_t size = sizeof(ArchiveBlock) + block.packed_size;
+    if (size > *capacity) {
+        *capacity = size;
+        *data = xrealloc(*data, *capacity);
+    }
+    if (pread(archive_fd, *data, size, offset) != (ssize_t)size) return 0;
+    return block.checksum == block_checksum(&block, *data + sizeof(ArchiveBlock));
+}
+
+// Moves the todos of archive block n back into the store and drops it from
+// the table. Todos already back in the store are left as they are.
+int thaw_block(int n) {
+    const char *raw = unpack_block(n);
+    if (!raw) return 0;
+    restore_block(n, raw);
+    return 1;
+}
+
+// Decompresses archive block n into a buffer that stays valid until the
+// next call; NULL if the block cannot be read
+const char* unpack_block(int n) {
+    static char *packed = NULL, *raw = NULL;
+    static size_t packed_capacity = 0, raw_capacity = 0;
+    const ArchiveBlock *block = &archive[n].block;
+    if (!load_archive_block(&archive[n], &packed, &packed_capacity)) return NULL;
+    if (block->raw_size > raw_capacity) {
+        raw_capacity = block->raw_size;
+        raw = xrealloc(raw, raw_capacity);
+    }
+    uLongf raw_size = block->raw_size;
+    if (uncompress((Bytef *)raw, &raw_size, (const Bytef *)packed + sizeof(ArchiveBlock),
+                   block->packed_size) != Z_OK || raw_size != block->raw_size) {
+        return NULL;
+    }
+    return raw;
+}
+
+void restore_block(int n, const char *raw) {
+    restore_entries(raw, archive[n].block.raw_size, archive[n].block.count, 0);
+    archived_todos -= archive[n].block.count;
+    memmove(&archive[n], &archive[n + 1], (archive_count - n - 1) * sizeof(ArchiveRef));
+    archive_count--;
+}
+
+// Thaws the archive blocks that may hold matches for query, or every block
+// without one. A query with text terms only thaws the blocks whose todos,
+// read in place, actually contain them, and remembers the blocks that do
+// not, so typing a search reads each block once. Each thaw is journaled, so
+// its todos stay in the store.
+int thaw_archive(const Query *query, time_t now) {
+    if (archive_count == 0 || (query && !query_reads_archive(query))) return 0;
+    int count = query ? text_terms(query) : 0;
+    int thawed = 0;
+    for (int n = 0; n < archive_count;) {
+        uint64_t id = archive[n].block.id;
+        const char *raw = NULL;
+        if ((!query || block_may_match(&archive[n].block, query, now)) && !(count && archive_missed(id))) {
+            raw = unpack_block(n);
+        }
+        if (raw && count && !block_has_text(&archive[n].block, raw, count)) {
+            add_archive_miss(id);
+            raw = NULL;
+        }
+        if (!raw) {
+            n++;
+            continue;
+        }
+        restore_block(n, raw);
+        journal_append(OP_THAW, 0, (int64_t)id, NULL, 0);
+        thawed++;
+    }
+    return thawed;
+}
+
+// Folds the positive text terms of query into miss_terms and returns how
+// many there are. The remembered misses stay when each term only grew
+// around the one it replaces, since a block without the old text cannot
+// hold the new one either.
+int text_terms(const Query *query) {
+    char folded[QUERY_MAX_TERMS + QUICK_FILTER_TERMS][MAX_LENGTH];
+    int count = 0;
+    for (int n = 0; n < query->count; n++) {
+        const QueryTerm *term = &query->terms[n];
+        if (term->kind == TERM_TEXT && !term->negate) fold_ascii(folded[count++], term->text);
+    }
+
+    int narrower = count == miss_term_count;
+    for (int t = 0; t < count && narrower; t++) narrower = strstr(folded[t], miss_terms[t]) != NULL;
+    if (!narrower) archive_miss_count = 0;
+    for (int t = 0; t < count; t++) {
+        miss_term_lens[t] = strlen(folded[t]);
+        memcpy(miss_terms[t], folded[t], miss_term_lens[t] + 1);
+    }
+    miss_term_count = count;
+    return count;
+}
+
+int archive_missed(uint64_t id) {
+    int lo = 0, hi = archive_miss_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (archive_misses[mid] < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < archive_miss_count && archive_misses[lo] == id;
+}
+
+void add_archive_miss(uint64_t id) {
+    if (archive_miss_count == archive_miss_capacity) {
+        archive_miss_capacity = archive_miss_capacity ? archive_miss_capacity * 2 : 64;
+        archive_misses = xrealloc(archive_misses, archive_miss_capacity * sizeof(uint64_t));
+    }
+    int pos = archive_miss_count++;
+    while (pos > 0 && archive_misses[pos - 1] > id) {
+        archive_misses[pos] = archive_misses[pos - 1];
+        pos--;
+    }
+    archive_misses[pos] = id;
+}
+
+// Whether one of the unpacked todos of the block contains the first count
+// of miss_terms, as todo_contains() would find them
+int block_has_text(const ArchiveBlock *block, const char *raw, int count) {
+    size_t pos = 0;
+    RestoreEntry entry;
+    const char *text;
+    while ((text = next_archive_entry(raw, block->raw_size, &pos, &entry))) {
+        const char *category = text + entry.text_len;
+        int t = 0;
+        while (t < count &&
+               (find_folded(text, entry.text_len, miss_terms[t], miss_term_lens[t]) ||
+                find_folded(category, entry.category_len, miss_terms[t], miss_term_lens[t]))) {
+            t++;
+        }
+        if (t == count) return 1;
+    }
+    return 0;
+}
+
+// Reads the todo at *pos of an unpacked block of size bytes and moves past
+// it; returns its text, which its category follows, or NULL at the end
+const char* next_archive_entry(const char *raw, size_t size, size_t *pos, RestoreEntry *entry) {
+    if (*pos + sizeof(RestoreEntry) > size) return NULL;
+    memcpy(entry, raw + *pos, sizeof(RestoreEntry));
+    const char *text = raw + *pos + sizeof(RestoreEntry);
+    if (*pos + sizeof(RestoreEntry) + entry->text_len + entry->category_len > size) return NULL;
+    *pos += sizeof(RestoreEntry) + entry->text_len + entry->category_len;
+    return text;
+}
+
+// term_matches() for an archived todo, against the terms plan_query()
+// resolved. Its category need not be in the store, so it is compared by name.
+int entry_matches(const Query *query, const RestoreEntry *entry, const char *text) {
+    const char *category = text + entry->text_len;
+    for (int n = 0; n < query->count; n++) {
+        const QueryTerm *term = &query->terms[n];
+        int match;
+        if (term->kind == TERM_DONE) {
+            match = entry->done != 0;
+        } else if (term->kind == TERM_CATEGORY) {
+            match = entry->category_len == strlen(term->text) &&
+                    strncasecmp(category, term->text, entry->category_len) == 0;
+        } else if (term->kind == TERM_DUE) {
+            match = entry->due_date >= term->lo && entry->due_date < term->hi;
+        } else {
+            match = find_folded(text, entry->text_len, term->text, term->text_len) ||
+                    find_folded(category, entry->category_len, term->text, term->text_len);
+        }
+        if (match == term->negate) return 0;
+    }
+    return 1;
+}
+
+// Whether a headless view also lists the archived todos its plan passes
+int view_reads_archive() {
+    return archive_count > 0 && (view_archive || query_reads_archive(&view_plan.query));
+}
+
+// Prints the archived todos that pass the view's plan after the view
+// itself, block by block in due order, without bringing them back
+void print_archived(int format) {
+    static char text[UINT16_MAX + 1], category[UINT16_MAX + 1];
+    if (!view_reads_archive()) return;
+    for (int n = 0; n < archive_count; n++) {
+        if (!block_may_match(&archive[n].block, &view_plan.query, view_now)) continue;
+        const char *raw = unpack_block(n);
+        size_t pos = 0;
+        RestoreEntry entry;
+        const char *entry_text;
+        while (raw && (entry_text = next_archive_entry(raw, archive[n].block.raw_size, &pos, &entry))) {
+            if (find_slot(entry.uid) >= 0 || !entry_matches(&view_plan.query, &entry, entry_text)) {
+                continue;
+            }
+            memcpy(text, entry_text, entry.text_len);
+            text[entry.text_len] = '\0';
+            memcpy(category, entry_text + entry.text_len, entry.category_len);
+            category[entry.category_len] = '\0';
+            print_todo(format, entry.uid, entry.done, entry.due_date, entry.repeat, category, text);
+        }
+    }
+}
+
+// Slot of the todo with uid, thawing the archive block that holds it if it
+// is not in the store; -1 if there is none
+int thaw_todo(uint64_t uid) {
+    int idx = find_todo(uid);
+    for (int n = 0; idx < 0 && n < archive_count; n++) {
+        const char *raw = unpack_block(n);
+        size_t pos = 0;
+        RestoreEntry entry;
+        while (raw && next_archive_entry(raw, archive[n].block.raw_size, &pos, &entry)) {
+            if (entry.uid != uid) continue;
+            uint64_t id = archive[n].block.id;
+            restore_block(n, raw);
+            journal_append(OP_THAW, 0, (int64_t)id, NULL, 0);
+            idx = find_todo(uid);
+            break;
+        }
+    }
+    return idx;
+}
+
+// The archive holds only done todos, which a query reads only if it asks
+// for them or searches
+int query_reads_archive(const Query *query) {
+    int reads = 0;
+    for (int n = 0; n < query->count; n++) {
+        const QueryTerm *term = &query->terms[n];
+        if (term->kind == TERM_DONE && term->negate) return 0;
+        if ((term->kind == TERM_DONE || term->kind == TERM_TEXT) && !term->negate) reads = 1;
+    }
+    return reads;
+}
+
+// Whether the block's due date range and category filter allow a match for
+// every positive due and category term
+int block_may_match(const ArchiveBlock *block, const Query *query, time_t now) {
+    for (int n = 0; n < query->count; n++) {
+        const QueryTerm *term = &query->terms[n];
+        if (term->negate) continue;
+        if (term->kind == TERM_CATEGORY) {
+            uint64_t bits = category_bloom(term->text, strlen(term->text));
+            if ((block->bloom & bits) != bits) return 0;
+        } else if (term->kind == TERM_DUE) {
+            QueryTerm range = *term;
+            resolve_due_term(&range, now);
+            if (range.op == 'n' ? block->undated == 0
+                                : block->due_min >= range.hi || block->due_max < range.lo) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Copies the blocks in the archive table into a fresh archive file, which
+// leaves out those thaws dropped, and points the table at the copies
+int rewrite_archive() {
+    static char *data = NULL;
+    static size_t capacity = 0;
+    int fd = open(ARCHIVE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return 0;
+
+    uint64_t *offsets = xrealloc(NULL, (archive_count ? archive_count : 1) * sizeof(uint64_t));
+    uint64_t offset = 0;
+    int ok = 1;
+    for (int n = 0; n < archive_count && ok; n++) {
+        size_t size = sizeof(ArchiveBlock) + archive[n].block.packed_size;
+        ok = load_archive_block(&archive[n], &data, &capacity) &&
+             pwrite(fd, data, size, offset) == (ssize_t)size;
+        offsets[n] = offset;
+        offset += size;
+    }
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(ARCHIVE_FILE ".tmp", ARCHIVE_FILE) != 0) {
+        unlink(ARCHIVE_FILE ".tmp");
+        free(offsets);
+        return 0;
+    }
+
+    for (int n = 0; n < archive_count; n++) archive[n].offset = offsets[n];
+    free(offsets);
+    if (archive_fd >= 0) close(archive_fd);
+    archive_fd = -1;
+    return 1;
+}
+
+// Moves journal writes and snapshots off the UI thread, so a slow disk
+// never stalls a keypress. The persister writes whatever has been queued in
+// one go as soon as it is woken, and fsyncs at most every $TODO_SYNC_MS.
+// It also watches the journal for records other instances append.
+void start_persister() {
+    const char *sync_ms = getenv("TODO_SYNC_MS");
+    if (sync_ms && atoi(sync_ms) >= 0) persist_sync_ms = atoi(sync_ms);
+
+    if (!journal) return;
+    if (persist_notify[0] < 0 && pipe(persist_notify) == 0) {
+        fcntl(persist_notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(persist_notify[1], F_SETFL, O_NONBLOCK);
+    }
+    if (pipe(persist_wake) != 0) return;
+    fcntl(persist_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(persist_wake[1], F_SETFL, O_NONBLOCK);
+
+    persist_watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (persist_watch >= 0 && inotify_add_watch(persist_watch, JOURNAL_FILE, IN_MODIFY) < 0) {
+        close(persist_watch);
+        persist_watch = -1;
+    }
+
+    journal_pos = ftell(journal);
+    journal_generation = store_generation;
+    persist_stale = 0;
+    atomic_store(&persist_idle, 0);
+    if (pthread_create(&persist_thread, NULL, persister_main, NULL) == 0) {
+        persist_running = 1;
+    } else {
+        close(persist_wake[0]);
+        close(persist_wake[1]);
+        if (persist_watch >= 0) close(persist_watch);
+    }
+}
+
+// Hands the persister everything queued so far and waits for it to finish
+void stop_persister() {
+    if (!persist_running) return;
+    JournalRecord rec = {0};
+    rec.op = PERSIST_STOP;
+    persist_push(&rec, NULL);
+    pthread_join(persist_thread, NULL);
+    persist_running = 0;
+    close(persist_wake[0]);
+    close(persist_wake[1]);
+    if (persist_watch >= 0) close(persist_watch);
+    persist_watch = -1;
+}
+
+// Queues one message. Records too large for the ring travel as a pointer to
+// a copy. The UI thread only waits here if the disk has fallen a whole ring
+// behind.
+void persist_push(const JournalRecord *rec, const void *payload) {
+    size_t size = sizeof(JournalRecord) + rec->length;
+    if (size > PERSIST_RING_SIZE / 4) {
+        char *copy = xrealloc(NULL, size);
+        memcpy(copy, rec, sizeof(JournalRecord));
+        memcpy(copy + sizeof(JournalRecord), payload, rec->length);
+        JournalRecord ref = {0};
+        ref.op = PERSIST_RECORD;
+        ref.length = sizeof(char *);
+        persist_push(&ref, &copy);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&persist_head, memory_order_relaxed);
+    while (head + size - atomic_load_explicit(&persist_tail, memory_order_acquire) > PERSIST_RING_SIZE) {
+        if (write(persist_wake[1], "", 1) < 0) {}
+        usleep(1000);
+    }
+
+    const void *parts[2] = {rec, payload};
+    size_t lens[2] = {sizeof(JournalRecord), rec->length};
+    for (int p = 0; p < 2; p++) {
+        size_t pos = head % PERSIST_RING_SIZE;
+        size_t first = lens[p] < PERSIST_RING_SIZE - pos ? lens[p] : PERSIST_RING_SIZE - pos;
+        memcpy(persist_ring + pos, parts[p], first);
+        memcpy(persist_ring, (const char *)parts[p] + first, lens[p] - first);
+        head += lens[p];
+    }
+    atomic_store_explicit(&persist_head, head, memory_order_release);
+
+    if (atomic_exchange(&persist_idle, 0)) {
+        if (write(persist_wake[1], "", 1) < 0) {}
+    }
+}
+
+void persist_read(size_t pos, void *data, size_t len) {
+    pos %= PERSIST_RING_SIZE;
+    size_t first = len < PERSIST_RING_SIZE - pos ? len : PERSIST_RING_SIZE - pos;
+    memcpy(data, persist_ring + pos, first);
+    memcpy((char *)data + first, persist_ring, len - first);
+}
+
+// Writes out every queued message; returns 0 once asked to stop. Appends
+// happen under the journal lock, after reading whatever other instances
+// appended, so every instance sees the same order of records.
+int persist_drain() {
+    static char *payload = NULL;
+    static size_t capacity = 0;
+
+    size_t tail = atomic_load_explicit(&persist_tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&persist_head, memory_order_acquire);
+    if (tail == head) return 1;
+
+    flock(fileno(journal), LOCK_EX);
+    read_foreign_records(1);
+    fseek(journal, journal_pos, SEEK_SET);
+
+    PROFILE_BEGIN(drain);
+    int running = 1;
+    while (tail != head) {
+        JournalRecord rec;
+        persist_read(tail, &rec, sizeof(JournalRecord));
+        if (rec.length > capacity) {
+            capacity = rec.length;
+            payload = xrealloc(payload, capacity);
+        }
+        persist_read(tail + sizeof(JournalRecord), payload, rec.length);
+        tail += sizeof(JournalRecord) + rec.length;
+        atomic_store_explicit(&persist_tail, tail, memory_order_release);
+
+        if (rec.op == PERSIST_STOP) {
+            running = 0;
+        } else if (rec.op == PERSIST_SNAPSHOT) {
+            // A copy that lacks records other instances wrote would lose
+            // them, so it is only saved if the UI thread had applied all
+            StoreImage *image;
+            memcpy(&image, payload, sizeof(StoreImage *));
+            if (!persist_stale && image->foreign_applied == foreign_forwarded) {
+                sync_journal();
+                image->generation = journal_generation + 1;
+                if (save_todos(image)) {
+                    reset_journal(image->generation);
+                    journal_generation = image->generation;
+                }
+            }
+            free(image);
+        } else if (rec.op == PERSIST_RECORD) {
+            char *copy;
+            memcpy(&copy, payload, sizeof(char *));
+            JournalRecord *big = (JournalRecord *)copy;
+            fwrite(copy, 1, sizeof(JournalRecord) + big->length, journal);
+            PROFILE_COUNT(profile_bytes, sizeof(JournalRecord) + big->length);
+            journal_unsynced++;
+            free(copy);
+        } else {
+            fwrite(&rec, sizeof(JournalRecord), 1, journal);
+            fwrite(payload, 1, rec.length, journal);
+            PROFILE_COUNT(profile_bytes, sizeof(JournalRecord) + rec.length);
+            journal_unsynced++;
+        }
+        if (tail == head) head = atomic_load_explicit(&persist_head, memory_order_acquire);
+    }
+    fflush(journal);
+    PROFILE_END(drain, SPAN_PERSIST);
+    journal_pos = ftell(journal);
+    flock(fileno(journal), LOCK_UN);
+    return running;
+}
+
+// Queues the records other instances appended past journal_pos for the UI
+// thread. If the journal was reset by another instance's snapshot, asks the
+// UI thread to reload instead. Holding the lock exclusively, a torn record
+// left by a writer that crashed is cut off, so ours do not follow it.
+int read_foreign_records(int exclusive) {
+    static char *payload = NULL;
+    static size_t capacity = 0;
+
+    int fd = fileno(journal);
+    JournalHeader header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(JournalHeader), 0) != sizeof(JournalHeader) ||
+        fstat(fd, &st) != 0 || header.magic != JOURNAL_MAGIC ||
+        header.generation != journal_generation || st.st_size < journal_pos) {
+        journal_generation = header.generation;
+        journal_pos = st.st_size;
+        persist_stale = 1;
+        pthread_mutex_lock(&inbox_lock);
+        inbox_reload = 1;
+        pthread_mutex_unlock(&inbox_lock);
+        if (write(persist_notify[1], "", 1) < 0) {}
+        return 0;
+    }
+
+    int found = 0;
+    JournalRecord rec;
+    while (journal_pos + (long)sizeof(JournalRecord) <= st.st_size &&
+           pread(fd, &rec, sizeof(JournalRecord), journal_pos) == sizeof(JournalRecord) &&
+           rec.length <= JOURNAL_MAX_PAYLOAD &&
+           journal_pos + (long)sizeof(JournalRecord) + rec.length <= st.st_size) {
+        if (rec.length > capacity) {
+            capacity = rec.length;
+            payload = xrealloc(payload, capacity);
+        }
+        if (pread(fd, payload, rec.length, journal_pos + sizeof(JournalRecord)) != rec.length ||
+            rec.checksum != record_checksum(&rec, payload)) {
+            break;
+        }
+        inbox_push(&rec, payload);
+        journal_pos += sizeof(JournalRecord) + rec.length;
+        found = 1;
+    }
+    if (exclusive && journal_pos < st.st_size && ftruncate(fd, journal_pos) != 0) {}
+    if (found && write(persist_notify[1], "", 1) < 0) {}
+    return 1;
+}
+
+void inbox_push(const JournalRecord *rec, const char *payload) {
+    size_t size = sizeof(JournalRecord) + rec->length;
+    pthread_mutex_lock(&inbox_lock);
+    if (inbox_size + size > inbox_capacity) {
+        inbox_capacity = (inbox_size + size) * 2;
+        inbox = xrealloc(inbox, inbox_capacity);
+    }
+    memcpy(inbox + inbox_size, rec, sizeof(JournalRecord));
+    memcpy(inbox + inbox_size + sizeof(JournalRecord), payload, rec->length);
+    inbox_size += size;
+    foreign_forwarded += size;
+    pthread_mutex_unlock(&inbox_lock);
+}
+
+// Applies the records the persister read from other instances
+void apply_foreign_records() {
+    static char *records = NULL;
+    static size_t capacity = 0;
+
+    char drain[64];
+    while (read(persist_notify[0], drain, sizeof(drain)) > 0) {}
+
+    pthread_mutex_lock(&inbox_lock);
+    int reload = inbox_reload;
+    size_t size = reload ? 0 : inbox_size;
+    if (size > 0) {
+        char *swap = inbox;
+        size_t swap_capacity = inbox_capacity;
+        inbox = records;
+        inbox_capacity = capacity;
+        records = swap;
+        capacity = swap_capacity;
+        inbox_size = 0;
+    }
+    pthread_mutex_unlock(&inbox_lock);
+
+    if (reload) {
+        reload_store();
+        return;
+    }
+    for (size_t pos = 0; pos < size;) {
+        JournalRecord rec;
+        memcpy(&rec, records + pos, sizeof(JournalRecord));
+        replay_record(&rec, records + pos + sizeof(JournalRecord));
+        pos += sizeof(JournalRecord) + rec.length;
+        journal_records++;
+    }
+    foreign_applied += size;
+}
+
+// Waits for a key, applying what other instances change in the meantime
+int read_key() {
+    int ch;
+    nodelay(stdscr, TRUE);
+    while ((ch = getch()) == ERR) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {persist_notify[0], POLLIN, 0}};
+        int ready = poll(fds, 2, redraw_timeout());
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            apply_foreign_records();
+            draw_screen();
+        } else if (ready == 0) {
+            redraw_due();
+        }
+    }
+    nodelay(stdscr, FALSE);
+    return ch;
+}
+
+// Colour pair of a todo's due date: overdue or due soon, while pending
+int due_colour(int idx, time_t now) {
+    const Todo *todo = &todos[idx];
+    if (todo->done || todo->due_date <= 0) return 0;
+    if (todo->due_date < now) return 2;
+    return todo->due_date < now + DUE_SOON_SECONDS ? 3 : 0;
+}
+
+// Milliseconds until the screen next changes by itself, taken from the due
+// index: a pending todo's due date passes or gets closer than
+// DUE_SOON_SECONDS, changing its colour and the overdue count, or any due
+// date crosses the bound of a filter relative to now; -1 if nothing ever will
+int redraw_timeout() {
+    if (index_build_pending()) return REDRAW_RETRY_MS;
+    if (!due_ready) build_due_index();
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = ts.tv_sec;
+
+    int64_t wake = next_crossing(now, 0, INT64_MAX, 1);
+    wake = next_crossing(now, DUE_SOON_SECONDS, wake, 1);
+    for (int n = 0; n < view_plan.query.count; n++) {
+        const QueryTerm *term = &view_plan.query.terms[n];
+        if (term->kind != TERM_DUE || !term->relative || term->op == 'n') continue;
+        wake = next_crossing(now, term->value, wake, 0);
+        if (term->op == '=') {
+            // The day it matches also moves at midnight
+            struct tm tm_day;
+            time_t today = now;
+            localtime_r(&today, &tm_day);
+            tm_day.tm_hour = tm_day.tm_min = tm_day.tm_sec = 0;
+            tm_day.tm_mday++;
+            tm_day.tm_isdst = -1;
+            int64_t midnight = mktime(&tm_day);
+            if (midnight < wake) wake = midnight;
+        }
+    }
+    if (wake == INT64_MAX) return -1;
+
+    int64_t ms = (wake - now) * 1000 - ts.tv_nsec / 1000000;
+    return ms > INT32_MAX ? INT32_MAX : ms < 0 ? 0 : ms;
+}
+
+// The earlier of wake and the first time after now that the due date t of
+// some live todo, pending if asked, satisfies t < time + offset, which is
+// t - offset + 1. The due index keeps done todos and tombstones, which are
+// passed over.
+int64_t next_crossing(int64_t now, int64_t offset, int64_t wake, int pending) {
+    for (int pos = due_lower_bound(now + offset, INT32_MIN); pos < due_count; pos++) {
+        if (due_index[pos].due_date - offset + 1 >= wake) break;
+        const Todo *todo = &todos[due_index[pos].idx];
+        if ((todo->flags & TODO_DELETED) || (pending && todo->done)) continue;
+        wake = due_index[pos].due_date - offset + 1;
+        break;
+    }
+    return wake;
+}
+
+// A due date crossed a threshold. Views with filters relative to now may
+// gain or lose todos and are rebuilt; otherwise only the counts and the
+// visible rows whose colour changed are repainted.
+void redraw_due() {
+    for (int n = 0; n < view_plan.query.count; n++) {
+        if (view_plan.query.terms[n].kind == TERM_DUE && view_plan.query.terms[n].relative) {
+            invalidate_view();
+        }
+    }
+    if (view_dirty) {
+        draw_screen();
+        return;
+    }
+
+    time_t now = time(NULL);
+    draw_counts(now);
+    int view_rows = LINES - 4 < 1 ? 1 : LINES - 4;
+    for (int pos = scroll_top; pos < view.count && pos < scroll_top + view_rows; pos++) {
+        int idx = view.items[pos];
+        if (due_colour(idx, now) != due_colour(idx, rows_drawn_at)) {
+            draw_todo_row(3 + pos - scroll_top, pos, now);
+        }
+    }
+    rows_drawn_at = now;
+    refresh();
+}
+
+void* persister_main(void *arg) {
+    (void)arg;
+    struct timespec last_sync;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+    while (persist_drain()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long since = (now.tv_sec - last_sync.tv_sec) * 1000 + (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+        if (journal_unsynced && since >= persist_sync_ms) {
+            sync_journal();
+            last_sync = now;
+            since = 0;
+        }
+
+        // Sleep until woken, or until the pending fsync is due. The ring is
+        // checked again after going idle so a record queued meanwhile is not
+        // left waiting for the next one.
+        atomic_store(&persist_idle, 1);
+        if (atomic_load(&persist_head) != atomic_load(&persist_tail)) {
+            atomic_store(&persist_idle, 0);
+            continue;
+        }
+        int wait = persist_watch < 0 ? PERSIST_POLL_MS : -1;
+        if (journal_unsynced && (wait < 0 || persist_sync_ms - since < wait)) wait = persist_sync_ms - since;
+        struct pollfd fds[2] = {{persist_wake[0], POLLIN, 0}, {persist_watch, POLLIN, 0}};
+        int ready = poll(fds, 2, wait);
+        char drain[4096];
+        while (read(persist_wake[0], drain, sizeof(drain)) > 0) {}
+        atomic_store(&persist_idle, 0);
+
+        if (persist_watch < 0 ? ready == 0 : (fds[1].revents & POLLIN) != 0) {
+            while (persist_watch >= 0 && read(persist_watch, drain, sizeof(drain)) > 0) {}
+            flock(fileno(journal), LOCK_SH);
+            read_foreign_records(0);
+            flock(fileno(journal), LOCK_UN);
+        }
+    }
+    sync_journal();
+    return NULL;
+}
+
+// Headless commands. These never start curses: they load the store, replay
+// the journal, append their own changes to it and stream results to stdout.
+// A todo's id is its uid as printed by list.
+int run_command(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        int (*run)(int argc, char **argv);
+    } commands[] = {
+        {"add", command_add},
+        {"delete", command_delete},
+        {"list", command_list},
+        {"import", command_import},
+        {"export", command_export},
+    };
+
+    init_store();
+    if (strcmp(argv[0], "serve") == 0 && argc == 1) return command_serve();
+    if (strcmp(argv[0], "bench") == 0) return command_bench(argc - 1, argv + 1);
+
+    // With a daemon serving this directory its store is already loaded;
+    // otherwise the journal stays locked for the whole command
+    int remote = 0;
+    for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++) {
+        if (strcmp(argv[0], commands[c].name) == 0) remote = 1;
+    }
+    if (strcmp(argv[0], "done") == 0 || strcmp(argv[0], "undone") == 0) remote = 1;
+    if (remote) server_fd = connect_server();
+    if (server_fd < 0) open_store();
+
+    int status = -1;
+    if (strcmp(argv[0], "done") == 0 || strcmp(argv[0], "undone") == 0) {
+        status = command_set_done(argc - 1, argv + 1, argv[0][0] == 'd');
+    }
+    for (size_t c = 0; status < 0 && c < sizeof(commands) / sizeof(commands[0]); c++) {
+        if (strcmp(argv[0], commands[c].name) == 0) status = commands[c].run(argc - 1, argv + 1);
+    }
+    if (status < 0) {
+        fprintf(stderr,
+                "usage: app add TEXT... [--category=NAME] [--due=YYYY-MM-DD] [--repeat=RULE]\n"
+                "       app done|undone|delete ID...\n"
+                "       app list [--pending|--done] [--overdue|--upcoming] [--category=NAME]\n"
+                "                [--search=TERM] [--query=EXPR]\n"
+                "                [--sort=list|due|category|text|created]\n"
+                "       app import [--format=lines|csv|jsonl] FILE|-\n"
+                "       app export [--format=csv|jsonl] [list options]\n"
+                "       app serve\n"
+                "       app bench [--todos=N,...] [--runs=N] [--seed=N]\n");
+        status = 2;
+    }
+
+    if (server_fd >= 0) {
+        close(server_fd);
+        return status;
+    }
+
+    // Leave folding the journal to the next interactive session, so that
+    // scripted runs cost one append each
+    sync_journal();
+    if (journal) fclose(journal);
+    journal = NULL;
+    return status;
+}
+
+// The id scripts see is the todo's uid, which compaction never changes,
+// unlike its slot. Returns the slot of the live todo, or -1.
+int parse_todo_id(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long id = strtoull(arg, &end, 10);
+    int idx = isdigit((unsigned char)*arg) && *end == '\0' && errno == 0 ? thaw_todo(id) : -1;
+    if (idx < 0) fprintf(stderr, "minimal-todo: no todo with id %s\n", arg);
+    return idx;
+}
+
+// Words are joined into the text, the way the prompt would have read them
+int command_add(int argc, char **argv) {
+    char text[MAX_LENGTH] = "";
+    const char *category = NULL;
+    time_t due_date = 0;
+    uint32_t repeat = 0;
+    size_t len = 0;
+
+    for (int a = 0; a < argc; a++) {
+        if (strncmp(argv[a], "--category=", 11) == 0) {
+            category = argv[a] + 11;
+        } else if (strncmp(argv[a], "--due=", 6) == 0) {
+            if (!parse_date(argv[a] + 6, &due_date)) {
+                fprintf(stderr, "minimal-todo: bad date %s\n", argv[a] + 6);
+                return 1;
+            }
+        } else if (strncmp(argv[a], "--repeat=", 9) == 0) {
+            if (!parse_repeat(argv[a] + 9, &repeat)) {
+                fprintf(stderr, "minimal-todo: bad recurrence %s\n", argv[a] + 9);
+                return 1;
+            }
+        } else {
+            len += snprintf(text + len, MAX_LENGTH - len, "%s%s", len ? " " : "", argv[a]);
+            if (len >= MAX_LENGTH) len = MAX_LENGTH - 1;
+        }
+    }
+    if (len == 0) return -1;
+    if (!category) category = "";
+
+    uint64_t id;
+    if (server_fd >= 0) {
+        id = remote_add(text, len, category, due_date, repeat);
+        if (id == 0) return 1;
+    } else {
+        id = todos[add_record(text, len, category, strnlen(category, MAX_LENGTH - 1), due_date,
+                              repeat)].uid;
+    }
+    printf("%llu\n", (unsigned long long)id);
+    return 0;
+}
+
+// Adds a todo and journals each of its fields, returns its slot. A series
+// without a due date starts today.
+int add_record(const char *text, size_t len, const char *category, size_t category_len,
+               time_t due_date, uint32_t repeat) {
+    int idx = store_add(text, len, next_uid(), time(NULL));
+    journal_write(OP_ADD, idx, todos[idx].created_at, text, len);
+    if (category_len) {
+        store_set_category(idx, category, category_len);
+        journal_write(OP_CATEGORY, idx, 0, category, category_len);
+    }
+    // The due date first, so a monthly rule can take its day of the month
+    if (repeat && !due_date) due_date = start_of_day(time(NULL));
+    if (due_date) {
+        store_set_due_date(idx, due_date);
+        journal_write(OP_DUE, idx, due_date, NULL, 0);
+    }
+    if (repeat) {
+        store_set_repeat(idx, repeat);
+        journal_write(OP_REPEAT, idx, repeat, NULL, 0);
+    }
+    return idx;
+}
+
+// Marks a todo (not) done; completing a series moves it on to its next
+// occurrence instead
+void complete_todo(int idx, int done) {
+    if (done && todo_repeat(idx)) {
+        time_t next = next_occurrence(todos[idx].due_date, todo_repeat(idx), time(NULL));
+        store_set_due_date(idx, next);
+        journal_write(OP_DUE, idx, next, NULL, 0);
+    } else {
+        store_set_done(idx, done);
+        journal_write(OP_DONE, idx, done, NULL, 0);
+    }
+}
+
+int command_set_done(int argc, char **argv, int done) {
+    if (argc == 0) return -1;
+    if (server_fd >= 0) return remote_update(WIRE_SET_DONE, done, argc, argv);
+    for (int a = 0; a < argc; a++) {
+        if (parse_todo_id(argv[a]) < 0) return 1;
+    }
+    for (int a = 0; a < argc; a++) {
+        int idx = parse_todo_id(argv[a]);
+        if (idx >= 0) complete_todo(idx, done);
+    }
+    return 0;
+}
+
+int command_delete(int argc, char **argv) {
+    if (argc == 0) return -1;
+    if (server_fd >= 0) return remote_update(WIRE_DELETE, 0, argc, argv);
+    for (int a = 0; a < argc; a++) {
+        if (parse_todo_id(argv[a]) < 0) return 1;
+    }
+    for (int a = 0; a < argc; a++) {
+        int idx = parse_todo_id(argv[a]);
+        if (idx < 0) continue;
+        store_delete(idx);
+        journal_write(OP_DELETE, idx, 0, NULL, 0);
+    }
+    return 0;
+}
+
+// Sets the view filter an option of list or export names. Returns 0 for
+// an unknown option, -1 for a bad value it already reported.
+int parse_list_option(const char *arg) {
+    if (strcmp(arg, "--pending") == 0) {
+        filter_done = 0;
+    } else if (strcmp(arg, "--done") == 0) {
+        filter_done = 1;
+    } else if (strcmp(arg, "--overdue") == 0) {
+        filter_due = DUE_OVERDUE;
+    } else if (strcmp(arg, "--upcoming") == 0) {
+        filter_due = DUE_UPCOMING;
+    } else if (strncmp(arg, "--category=", 11) == 0) {
+        snprintf(filter_category, MAX_LENGTH, "%s", arg + 11);
+    } else if (strncmp(arg, "--search=", 9) == 0) {
+        snprintf(search_term, MAX_LENGTH, "%s", arg + 9);
+    } else if (strncmp(arg, "--query=", 8) == 0) {
+        const char *error;
+        if (!compile_query(arg + 8, &filter_terms, &error)) {
+            fprintf(stderr, "minimal-todo: bad query term %s\n", error);
+            return -1;
+        }
+        snprintf(filter_query, MAX_LENGTH, "%s", arg + 8);
+    } else if (strncmp(arg, "--sort=", 7) == 0) {
+        int mode = 0;
+        while (mode < SORT_MODES && strcasecmp(arg + 7, sort_name(mode)) != 0) mode++;
+        if (mode == SORT_MODES) return 0;
+        sort_mode = mode;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Prints one tab-separated line per match: id, done, due date, category, text
+int command_list(int argc, char **argv) {
+    for (int a = 0; a < argc; a++) {
+        int parsed = parse_list_option(argv[a]);
+        if (parsed <= 0) return parsed < 0 ? 2 : -1;
+    }
+
+    if (server_fd >= 0) return remote_query(FORMAT_LINES);
+
+    invalidate_view();
+    refresh_view();
+    for (int n = 0; n < view.count; n++) {
+        int i = view.items[n];
+        print_todo(FORMAT_LINES, todos[i].uid, todos[i].done, todos[i].due_date, todo_repeat(i),
+                   todo_category(i), todo_text(i));
+    }
+    print_archived(FORMAT_LINES);
+    return 0;
+}
+
+int parse_format(const char *arg, int *format) {
+    if (strncmp(arg, "--format=", 9) != 0) return 0;
+    arg += 9;
+    if (strcmp(arg, "lines") == 0) {
+        *format = FORMAT_LINES;
+    } else if (strcmp(arg, "csv") == 0) {
+        *format = FORMAT_CSV;
+    } else if (strcmp(arg, "jsonl") == 0) {
+        *format = FORMAT_JSONL;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Streams todos from FILE, or stdin for -, one record per line: plain text
+// lines, CSV with text,category,due,done,repeat columns, or JSONL objects with
+// those keys. The format defaults to the file's extension. Memory stays
+// bounded by the read buffer, and malformed lines are reported and skipped.
+//
+// The whole import is one pass over the store with the indexes set aside,
+// so they are rebuilt once on next use, and it is then written as a single
+// snapshot rather than one journal record per field: an interrupted import
+// leaves the store as it was.
+int command_import(int argc, char **argv) {
+    int format = -1;
+    const char *path = NULL;
+    for (int a = 0; a < argc; a++) {
+        if (parse_format(argv[a], &format)) continue;
+        if (path || strncmp(argv[a], "--", 2) == 0) return -1;
+        path = argv[a];
+    }
+    if (!path) return -1;
+    // The import is saved as a new snapshot, which a daemon's own store
+    // would overwrite at its next compaction
+    if (server_fd >= 0) {
+        fprintf(stderr, "minimal-todo: stop the daemon serving this directory to import\n");
+        return 1;
+    }
+    if (format < 0) {
+        const char *ext = strrchr(path, '.');
+        format = ext && strcmp(ext, ".csv") == 0 ? FORMAT_CSV
+               : ext && (strcmp(ext, ".jsonl") == 0 || strcmp(ext, ".json") == 0) ? FORMAT_JSONL
+               : FORMAT_LINES;
+    }
+
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    setvbuf(in, NULL, _IOFBF, IMPORT_CHUNK);
+
+    drop_trigram_index();
+    due_ready = 0;
+    columns_ready = 0;
+    counters_ready = 0;
+    drop_sort_orders();
+
+    static char line[IMPORT_LINE_MAX];
+    char *fields[IMPORT_FIELDS];
+    size_t lens[IMPORT_FIELDS];
+    long line_number = 0, added = 0, skipped = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line_number++;
+        size_t len = strcspn(line, "\r\n");
+        if (line[len] == '\0' && !feof(in)) {
+            int ch;
+            while ((ch = fgetc(in)) != EOF && ch != '\n') {}
+            fprintf(stderr, "minimal-todo: %s:%ld: line too long, skipped\n", path, line_number);
+            skipped++;
+            continue;
+        }
+        line[len] = '\0';
+        if (len == 0) continue;
+
+        int ok;
+        memset(fields, 0, sizeof(fields));
+        memset(lens, 0, sizeof(lens));
+        if (format == FORMAT_CSV) {
+            ok = parse_csv_record(line, fields, lens);
+            // A header row names its columns
+            if (ok && line_number == 1 && lens[0] == 4 && strncasecmp(fields[0], "text", 4) == 0) continue;
+        } else if (format == FORMAT_JSONL) {
+            ok = parse_json_record(line, fields, lens);
+        } else {
+            fields[0] = line;
+            lens[0] = len;
+            ok = 1;
+        }
+
+        if (ok && import_record(fields, lens)) {
+            added++;
+        } else {
+            fprintf(stderr, "minimal-todo: %s:%ld: malformed record, skipped\n", path, line_number);
+            skipped++;
+        }
+    }
+    if (in != stdin) fclose(in);
+
+    // The rows are not journaled one by one; the snapshot is what keeps them
+    if (added > 0 && !compact_journal()) {
+        fprintf(stderr, "minimal-todo: cannot save %s\n", DATA_FILE);
+        return 1;
+    }
+    printf("%ld\n", added);
+    return skipped > 0;
+}
+
+// Adds one todo from its text, category, due, done and repeat fields. Text and
+// category are clipped to what the prompts accept, and control characters
+// become spaces so every todo still prints on one line.
+int import_record(char **fields, size_t *lens) {
+    time_t due_date = 0;
+    uint32_t repeat = 0;
+    int done = 0;
+
+    if (lens[0] == 0) return 0;
+    for (int f = 0; f < 2; f++) {
+        if (lens[f] >= MAX_LENGTH) lens[f] = MAX_LENGTH - 1;
+        for (size_t c = 0; c < lens[f]; c++) {
+            if ((unsigned char)fields[f][c] < 0x20) fields[f][c] = ' ';
+        }
+    }
+    if (fields[2]) {
+        fields[2][lens[2]] = '\0';
+        if (!parse_date(fields[2], &due_date)) return 0;
+    }
+    if (fields[3]) {
+        fields[3][lens[3]] = '\0';
+        if (strcmp(fields[3], "1") == 0 || strcasecmp(fields[3], "true") == 0 ||
+            strcasecmp(fields[3], "x") == 0) {
+            done = 1;
+        } else if (lens[3] != 0 && strcmp(fields[3], "0") != 0 && strcasecmp(fields[3], "false") != 0) {
+            return 0;
+        }
+    }
+    if (fields[4]) {
+        fields[4][lens[4]] = '\0';
+        if (!parse_repeat(fields[4], &repeat)) return 0;
+        // As add does, a series without a date starts today
+        if (repeat && !due_date) due_date = start_of_day(time(NULL));
+    }
+
+    int idx = store_add(fields[0], lens[0], next_uid(), time(NULL));
+    if (lens[1] > 0) store_set_category(idx, fields[1], lens[1]);
+    if (due_date) store_set_due_date(idx, due_date);
+    if (repeat) store_set_repeat(idx, repeat);
+    if (done) store_set_done(idx, 1);
+    return 1;
+}
+
+// Splits a CSV record in place. Quoted fields may hold commas and doubled
+// quotes, but not line breaks, which todos never contain.
+int parse_csv_record(char *line, char **fields, size_t *lens) {
+    char *pos = line;
+    for (int f = 0; ; f++) {
+        if (f == IMPORT_FIELDS) return 0;
+        fields[f] = pos;
+        char *out = pos;
+        if (*pos == '"') {
+            pos++;
+            for (;;) {
+                if (*pos == '\0') return 0;
+                if (*pos == '"' && pos[1] != '"') break;
+                if (*pos == '"') pos++;
+                *out++ = *pos++;
+            }
+            pos++;
+            if (*pos != ',' && *pos != '\0') return 0;
+        } else {
+            while (*pos != ',' && *pos != '\0') {
+                if (*pos == '"') return 0;
+                *out++ = *pos++;
+            }
+        }
+        lens[f] = out - fields[f];
+        if (*pos == '\0') return 1;
+        pos++;
+    }
+}
+
+// Reads a JSON string at *pos, unescaping it in place
+int parse_json_string(char **pos, char **value, size_t *len) {
+    char *in = *pos;
+    if (*in++ != '"') return 0;
+    char *out = in;
+    *value = in;
+    while (*in != '"') {
+        unsigned char ch = *in++;
+        if (ch == '\0' || ch < 0x20) return 0;
+        if (ch != '\\') {
+            *out++ = ch;
+            continue;
+        }
+        switch (*in++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                unsigned code;
+                if (!parse_hex4(in, &code)) return 0;
+                in += 4;
+                if (code >= 0xd800 && code < 0xdc00) {
+                    unsigned low;
+                    if (in[0] != '\\' || in[1] != 'u' || !parse_hex4(in + 2, &low) ||
+                        low < 0xdc00 || low >= 0xe000) return 0;
+                    in += 6;
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                } else if (code >= 0xdc00 && code < 0xe000) {
+                    return 0;
+                }
+                // UTF-8 is never longer than the escape it replaces
+                if (code < 0x80) {
+                    *out++ = code;
+                } else if (code < 0x800) {
+                    *out++ = 0xc0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3f);
+                } else if (code < 0x10000) {
+                    *out++ = 0xe0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                } else {
+                    *out++ = 0xf0 | (code >> 18);
+                    *out++ = 0x80 | ((code >> 12) & 0x3f);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+    *len = out - *value;
+    *pos = in + 1;
+    return 1;
+}
+
+// Exactly four hex digits, as in a \u escape; no sign, blank or 0x
+int parse_hex4(const char *str, unsigned *code) {
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned char c = str[i];
+        if (!isxdigit(c)) return 0;
+        *code = *code << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return 1;
+}
+
+// Reads a flat JSON object. String values are unescaped in place and
+// true/false/numbers are kept as their text; unknown keys are ignored.
+int parse_json_record(char *line, char **fields, size_t *lens) {
+    static const char *keys[IMPORT_FIELDS] = {"text", "category", "due", "done", "repeat"};
+    char *pos = line;
+
+    while (isspace((unsigned char)*pos)) pos++;
+    if (*pos++ != '{') return 0;
+    for (;;) {
+        while (isspace((unsigned char)*pos)) pos++;
+
+        char *key, *value;
+        size_t key_len, value_len;
+        if (!parse_json_string(&pos, &key, &key_len)) return 0;
+        while (isspace((unsigned char)*pos)) pos++;
+        if (*pos++ != ':') return 0;
+        while (isspace((unsigned char)*pos)) pos++;
+
+        if (*pos == '"') {
+            if (!parse_json_string(&pos, &value, &value_len)) return 0;
+        } else {
+            value = pos;
+            while (isalnum((unsigned char)*pos) || *pos == '-' || *pos == '+' || *pos == '.') pos++;
+            value_len = pos - value;
+            if (value_len == 0) return 0;
+            if (value_len == 4 && strncmp(value, "null", 4) == 0) value = NULL;
+        }
+
+        for (int f = 0; f < IMPORT_FIELDS && value; f++) {
+            if (key_len == strlen(keys[f]) && strncmp(key, keys[f], key_len) == 0) {
+                fields[f] = value;
+                lens[f] = value_len;
+            }
+        }
+
+        while (isspace((unsigned char)*pos)) pos++;
+        if (*pos == ',') {
+            pos++;
+            continue;
+        }
+        if (*pos != '}') return 0;
+        break;
+    }
+    pos++;
+    while (isspace((unsigned char)*pos)) pos++;
+    return *pos == '\0';
+}
+
+void write_csv_field(const char *str, FILE *out) {
+    if (!strpbrk(str, ",\"\r\n")) {
+        fputs(str, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"') fputc('"', out);
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+void write_json_string(const char *str, FILE *out) {
+    fputc('"', out);
+    for (; *str; str++) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            fputc('\\', out);
+            fputc(ch, out);
+        } else if (ch < 0x20) {
+            fprintf(out, "\\u%04x", ch);
+        } else {
+            fputc(ch, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Streams the todos matching the list options, in view order and then the
+// archived ones, as CSV (with a header row) or JSONL that import reads back
+int command_export(int argc, char **argv) {
+    int format = FORMAT_CSV;
+    for (int a = 0; a < argc; a++) {
+        if (parse_format(argv[a], &format)) continue;
+        int parsed = parse_list_option(argv[a]);
+        if (parsed <= 0) return parsed < 0 ? 2 : -1;
+    }
+    if (format == FORMAT_LINES) return -1;
+
+    setvbuf(stdout, NULL, _IOFBF, IMPORT_CHUNK);
+    if (format == FORMAT_CSV) fputs("text,category,due,done,repeat\n", stdout);
+    view_archive = 1; // An export is a full copy
+    if (server_fd >= 0) return remote_query(format) || ferror(stdout) ? 1 : 0;
+
+    invalidate_view();
+    refresh_view();
+    for (int n = 0; n < view.count; n++) {
+        int i = view.items[n];
+        print_todo(format, todos[i].uid, todos[i].done, todos[i].due_date, todo_repeat(i),
+                   todo_category(i), todo_text(i));
+    }
+    print_archived(format);
+    return ferror(stdout) ? 1 : 0;
+}
+
+// Prints a todo as a line of list (FORMAT_LINES: id, done, due date,
+// category and text, tab-separated) or a record of export, which also
+// carries its recurrence rule so that import brings the series back
+void print_todo(int format, uint64_t id, int done, int64_t due_date, uint32_t repeat,
+                const char *category, const char *text) {
+    char date_str[DATE_LENGTH] = "";
+    if (due_date > 0) format_date(due_date, date_str);
+    // With the day a monthly series keeps, which a clamped due date hides
+    char repeat_str[REPEAT_LENGTH + 3] = "";
+    if (repeat) format_repeat(repeat, repeat_str);
+    if (repeat >> REPEAT_DAY_SHIFT) {
+        snprintf(repeat_str + strlen(repeat_str), 4, "@%u", (repeat >> REPEAT_DAY_SHIFT) & 31);
+    }
+
+    if (format == FORMAT_LINES) {
+        printf("%llu\t%d\t%s\t%s\t%s\n", (unsigned long long)id, done,
+               date_str[0] ? date_str : "-", category, text);
+    } else if (format == FORMAT_CSV) {
+        write_csv_field(text, stdout);
+        fputc(',', stdout);
+        write_csv_field(category, stdout);
+        printf(",%s,%d,%s\n", date_str, done, repeat_str);
+    } else {
+        fputs("{\"text\":", stdout);
+        write_json_string(text, stdout);
+        fputs(",\"category\":", stdout);
+        write_json_string(category, stdout);
+        if (date_str[0]) printf(",\"due\":\"%s\"", date_str);
+        printf(",\"done\":%s", done ? "true" : "false");
+        if (repeat_str[0]) printf(",\"repeat\":\"%s\"", repeat_str);
+        fputs("}\n", stdout);
+    }
+}
+
+
+// Socket of a daemon serving this directory, or -1 if none is running
+int connect_server() {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SOCKET_FILE);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int wire_write(int fd, const void *data, size_t len) {
+    const char *pos = data;
+    while (len > 0) {
+        ssize_t n = send(fd, pos, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int wire_read(int fd, void *data, size_t len) {
+    char *pos = data;
+    while (len > 0) {
+        ssize_t n = read(fd, pos, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int wire_send(int fd, int op, int64_t value, const void *payload, size_t len) {
+    WireFrame frame = {0};
+    frame.length = len;
+    frame.tag = ++wire_tag;
+    frame.value = value;
+    frame.op = op;
+    return wire_write(fd, &frame, sizeof(WireFrame)) && (len == 0 || wire_write(fd, payload, len));
+}
+
+int wire_receive(int fd, WireFrame *frame, char **payload, size_t *capacity) {
+    if (!wire_read(fd, frame, sizeof(WireFrame)) || frame->length > WIRE_MAX_PAYLOAD) return 0;
+    if (frame->length + 1 > *capacity) {
+        *capacity = frame->length + 1;
+        *payload = xrealloc(*payload, *capacity);
+    }
+    (*payload)[frame->length] = '\0';
+    return wire_read(fd, *payload, frame->length);
+}
+
+// Returns the id the daemon gave the todo, or 0
+uint64_t remote_add(const char *text, size_t len, const char *category, time_t due_date,
+                    uint32_t repeat) {
+    char payload[2 * MAX_LENGTH + sizeof(uint32_t)];
+    size_t category_len = strnlen(category, MAX_LENGTH - 1);
+    memcpy(payload, text, len);
+    payload[len] = '\0';
+    memcpy(payload + len + 1, category, category_len);
+    size_t size = len + 1 + category_len;
+    if (repeat) {
+        payload[size++] = '\0';
+        memcpy(payload + size, &repeat, sizeof(uint32_t));
+        size += sizeof(uint32_t);
+    }
+
+    WireFrame frame;
+    char *reply = NULL;
+    size_t capacity = 0;
+    uint64_t id = 0;
+    if (wire_send(server_fd, WIRE_ADD, due_date, payload, size) &&
+        wire_receive(server_fd, &frame, &reply, &capacity) && frame.op == WIRE_OK) {
+        id = frame.value;
+    } else {
+        fprintf(stderr, "minimal-todo: the daemon did not add the todo\n");
+    }
+    free(reply);
+    return id;
+}
+
+// Sends all ids in one request; the daemon stops at the first one it lacks
+int remote_update(int op, int64_t value, int argc, char **argv) {
+    uint64_t *ids = xrealloc(NULL, argc * sizeof(uint64_t));
+    for (int a = 0; a < argc; a++) {
+        char *end;
+        errno = 0;
+        unsigned long long id = strtoull(argv[a], &end, 10);
+        if (!isdigit((unsigned char)*argv[a]) || *end != '\0' || errno != 0) {
+            fprintf(stderr, "minimal-todo: no todo with id %s\n", argv[a]);
+            free(ids);
+            return 1;
+        }
+        ids[a] = id;
+    }
+
+    WireFrame frame;
+    char *reply = NULL;
+    size_t capacity = 0;
+    int status = 1;
+    if (!wire_send(server_fd, op, value, ids, argc * sizeof(uint64_t)) ||
+        !wire_receive(server_fd, &frame, &reply, &capacity)) {
+        fprintf(stderr, "minimal-todo: lost the connection to the daemon\n");
+    } else if (frame.op == WIRE_ERROR) {
+        fprintf(stderr, "minimal-todo: no todo with id %llu\n", (unsigned long long)frame.value);
+    } else {
+        status = 0;
+    }
+    free(ids);
+    free(reply);
+    return status;
+}
+
+// Sends the view filters as a query and prints the rows as pages arrive
+int remote_query(int format) {
+    WireQuery query = {0};
+    query.done = filter_done;
+    query.due = filter_due;
+    query.sort = sort_mode;
+    query.flags = view_archive ? WIRE_QUERY_ARCHIVE : 0;
+    query.category_len = strlen(filter_category);
+    query.search_len = strlen(search_term);
+    query.query_len = strlen(filter_query);
+
+    char request[sizeof(WireQuery) + 3 * MAX_LENGTH];
+    char *pos = request + sizeof(WireQuery);
+    memcpy(request, &query, sizeof(WireQuery));
+    memcpy(pos, filter_category, query.category_len);
+    memcpy(pos + query.category_len, search_term, query.search_len);
+    memcpy(pos + query.category_len + query.search_len, filter_query, query.query_len);
+    if (!wire_send(server_fd, WIRE_QUERY, 0, request,
+                   sizeof(WireQuery) + query.category_len + query.search_len + query.query_len)) {
+        fprintf(stderr, "minimal-todo: lost the connection to the daemon\n");
+        return 1;
+    }
+
+    WireFrame frame;
+    char *payload = NULL;
+    size_t capacity = 0;
+    char text[UINT16_MAX + 1], category[UINT16_MAX + 1];
+    while (wire_receive(server_fd, &frame, &payload, &capacity)) {
+        if (frame.op != WIRE_ROWS) {
+            free(payload);
+            return frame.op == WIRE_OK ? 0 : 1;
+        }
+        for (size_t pos = 0; pos + WIRE_ROW_HEADER <= frame.length;) {
+            uint64_t id;
+            int64_t due_date;
+            uint16_t text_len, category_len;
+            uint32_t repeat;
+            memcpy(&id, payload + pos, 8);
+            memcpy(&due_date, payload + pos + 8, 8);
+            int done = payload[pos + 16];
+            memcpy(&text_len, payload + pos + 17, 2);
+            memcpy(&category_len, payload + pos + 19, 2);
+            memcpy(&repeat, payload + pos + 21, 4);
+            pos += WIRE_ROW_HEADER;
+            if (pos + text_len + category_len > frame.length) break;
+
+            memcpy(text, payload + pos, text_len);
+            text[text_len] = '\0';
+            memcpy(category, payload + pos + text_len, category_len);
+            category[category_len] = '\0';
+            pos += text_len + category_len;
+            print_todo(format, id, done, due_date, repeat, category, text);
+        }
+    }
+    free(payload);
+    fprintf(stderr, "minimal-todo: lost the connection to the daemon\n");
+    return 1;
+}
+
+void stop_serving(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+// Keeps the store and its indexes loaded and answers scripted commands on
+// SOCKET_FILE until SIGINT or SIGTERM. Like the TUI it is one instance
+// among those sharing the data file, so TUIs and commands run without the
+// daemon still see its changes. Everything runs on this thread, as in the
+// TUI; clients are served in turn as their sockets become ready.
+int command_serve() {
+    int fd = connect_server();
+    if (fd >= 0) {
+        close(fd);
+        fprintf(stderr, "minimal-todo: a daemon already serves this directory\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", SOCKET_FILE);
+    unlink(SOCKET_FILE);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "minimal-todo: cannot listen on %s\n", SOCKET_FILE);
+        return 1;
+    }
+
+    open_store();
+    archive_done_todos();
+    if (journal) flock(fileno(journal), LOCK_UN);
+    start_index_build();
+    start_persister();
+    if (journal && !persist_running) {
+        fprintf(stderr, "minimal-todo: cannot start the persister thread\n");
+        return 1;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    Client *clients = xrealloc(NULL, SERVE_MAX_CLIENTS * sizeof(Client));
+    struct pollfd *fds = xrealloc(NULL, (SERVE_MAX_CLIENTS + 2) * sizeof(struct pollfd));
+    int client_count = 0;
+    while (!serve_stop) {
+        fds[0] = (struct pollfd){listener, POLLIN, 0};
+        fds[1] = (struct pollfd){persist_notify[0], POLLIN, 0};
+        for (int n = 0; n < client_count; n++) {
+            Client *c = &clients[n];
+            short events = 0;
+            if (!c->streaming && c->out_size - c->out_sent < WIRE_PAGE_BYTES) events |= POLLIN;
+            if (c->out_size > c->out_sent || c->streaming) events |= POLLOUT;
+            fds[n + 2] = (struct pollfd){c->fd, events, 0};
+        }
+        if (poll(fds, client_count + 2, -1) < 0) continue;
+
+        if (fds[1].revents & POLLIN) apply_foreign_records();
+        for (int n = client_count - 1; n >= 0; n--) {
+            if (fds[n + 2].revents && !serve_client(&clients[n], fds[n + 2].revents)) {
+                Client *c = &clients[n];
+                close(c->fd);
+                free(c->in);
+                free(c->out);
+                free(c->rows);
+                free(c->blocks);
+                clients[n] = clients[--client_count];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                if (client_count == SERVE_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                clients[client_count++] = (Client){.fd = fd};
+            }
+        }
+    }
+
+    for (int n = 0; n < client_count; n++) close(clients[n].fd);
+    close(listener);
+    unlink(SOCKET_FILE);
+    close_journal();
+    return 0;
+}
+
+// Reads and answers what a client sent, pipelined requests in order and a
+// page of rows at a time; returns 0 once the client is gone
+int serve_client(Client *c, short revents) {
+    if (revents & POLLIN) {
+        if (c->in_capacity - c->in_size < WIRE_PAGE_BYTES) {
+            c->in_capacity = c->in_capacity * 2 + WIRE_PAGE_BYTES;
+            c->in = xrealloc(c->in, c->in_capacity);
+        }
+        ssize_t n = read(c->fd, c->in + c->in_size, c->in_capacity - c->in_size);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) return 0;
+        if (n > 0) c->in_size += n;
+    } else if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return 0;
+    }
+
+    // A query's rows go out before the requests behind it are read
+    size_t pos = 0;
+    WireFrame frame;
+    while (c->out_size - c->out_sent < WIRE_PAGE_BYTES) {
+        if (c->streaming) {
+            serve_rows(c);
+            continue;
+        }
+        if (c->in_size - pos < sizeof(WireFrame)) break;
+        memcpy(&frame, c->in + pos, sizeof(WireFrame));
+        if (frame.length > WIRE_MAX_PAYLOAD) return 0;
+        if (c->in_size - pos < sizeof(WireFrame) + frame.length) break;
+        serve_request(c, &frame, c->in + pos + sizeof(WireFrame));
+        pos += sizeof(WireFrame) + frame.length;
+    }
+    memmove(c->in, c->in + pos, c->in_size - pos);
+    c->in_size -= pos;
+
+    while (c->out_sent < c->out_size) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_size - c->out_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) return 0;
+        c->out_sent += n;
+    }
+    if (c->out_sent == c->out_size) c->out_sent = c->out_size = 0;
+    return 1;
+}
+
+void client_reply(Client *c, int op, uint32_t tag, int64_t value, const void *payload, size_t len) {
+    if (c->out_sent > 0) {
+        memmove(c->out, c->out + c->out_sent, c->out_size - c->out_sent);
+        c->out_size -= c->out_sent;
+        c->out_sent = 0;
+    }
+    if (c->out_size + sizeof(WireFrame) + len > c->out_capacity) {
+        c->out_capacity = (c->out_size + sizeof(WireFrame) + len) * 2;
+        c->out = xrealloc(c->out, c->out_capacity);
+    }
+    WireFrame frame = {0};
+    frame.length = len;
+    frame.tag = tag;
+    frame.value = value;
+    frame.op = op;
+    memcpy(c->out + c->out_size, &frame, sizeof(WireFrame));
+    if (len) memcpy(c->out + c->out_size + sizeof(WireFrame), payload, len);
+    c->out_size += sizeof(WireFrame) + len;
+}
+
+void serve_request(Client *c, const WireFrame *frame, const char *payload) {
+    if (frame->op == WIRE_ADD) {
+        size_t len = strnlen(payload, frame->length);
+        const char *category = payload + len + 1;
+        size_t category_len = len < frame->length ? strnlen(category, frame->length - len - 1) : 0;
+        if (len == 0) {
+            client_reply(c, WIRE_ERROR, frame->tag, 0, NULL, 0);
+            return;
+        }
+        uint32_t repeat = 0;
+        size_t repeat_pos = len + 1 + category_len + 1;
+        if (repeat_pos + sizeof(uint32_t) <= frame->length) {
+            memcpy(&repeat, payload + repeat_pos, sizeof(uint32_t));
+            if (!valid_repeat(repeat)) repeat = 0;
+        }
+        if (len >= MAX_LENGTH) len = MAX_LENGTH - 1;
+        if (category_len >= MAX_LENGTH) category_len = MAX_LENGTH - 1;
+        int idx = add_record(payload, len, category, category_len, frame->value, repeat);
+        client_reply(c, WIRE_OK, frame->tag, todos[idx].uid, NULL, 0);
+    } else if (frame->op == WIRE_SET_DONE || frame->op == WIRE_DELETE) {
+        // Every id is checked before any is applied, so a bad one changes nothing
+        for (size_t pos = 0; pos + sizeof(uint64_t) <= frame->length; pos += sizeof(uint64_t)) {
+            uint64_t id;
+            memcpy(&id, payload + pos, sizeof(uint64_t));
+            if (thaw_todo(id) < 0) {
+                client_reply(c, WIRE_ERROR, frame->tag, id, NULL, 0);
+                return;
+            }
+        }
+        for (size_t pos = 0; pos + sizeof(uint64_t) <= frame->length; pos += sizeof(uint64_t)) {
+            uint64_t id;
+            memcpy(&id, payload + pos, sizeof(uint64_t));
+            int idx = find_todo(id);
+            if (idx < 0) continue;
+            if (frame->op == WIRE_DELETE) {
+                store_delete(idx);
+                journal_write(OP_DELETE, idx, 0, NULL, 0);
+            } else {
+                complete_todo(idx, frame->value != 0);
+            }
+        }
+        client_reply(c, WIRE_OK, frame->tag, 0, NULL, 0);
+    } else if (frame->op == WIRE_QUERY) {
+        serve_query(c, frame, payload);
+    } else {
+        client_reply(c, WIRE_ERROR, frame->tag, 0, NULL, 0);
+    }
+}
+
+// Builds the view the query asks for and starts streaming it
+void serve_query(Client *c, const WireFrame *frame, const char *payload) {
+    WireQuery query;
+    if (frame->length < sizeof(WireQuery)) {
+        client_reply(c, WIRE_ERROR, frame->tag, 0, NULL, 0);
+        return;
+    }
+    memcpy(&query, payload, sizeof(WireQuery));
+    if (query.done < -1 || query.done > 1 || query.due < DUE_ALL || query.due > DUE_UPCOMING ||
+        query.sort < SORT_NONE || query.sort >= SORT_MODES || query.category_len >= MAX_LENGTH ||
+        query.search_len >= MAX_LENGTH || query.query_len >= MAX_LENGTH ||
+        sizeof(WireQuery) + query.category_len + query.search_len + query.query_len > frame->length) {
+        client_reply(c, WIRE_ERROR, frame->tag, 0, NULL, 0);
+        return;
+    }
+
+    const char *error;
+    const char *text = payload + sizeof(WireQuery) + query.category_len + query.search_len;
+    memcpy(filter_query, text, query.query_len);
+    filter_query[query.query_len] = '\0';
+    if (!compile_query(filter_query, &filter_terms, &error)) {
+        client_reply(c, WIRE_ERROR, frame->tag, 0, NULL, 0);
+        return;
+    }
+
+    filter_done = query.done;
+    filter_due = query.due;
+    sort_mode = query.sort;
+    view_archive = (query.flags & WIRE_QUERY_ARCHIVE) != 0;
+    memcpy(filter_category, payload + sizeof(WireQuery), query.category_len);
+    filter_category[query.category_len] = '\0';
+    memcpy(search_term, payload + sizeof(WireQuery) + query.category_len, query.search_len);
+    search_term[query.search_len] = '\0';
+    invalidate_view();
+    refresh_view();
+
+    if (view.count > 0) c->rows = xrealloc(c->rows, view.count * sizeof(uint64_t));
+    for (int n = 0; n < view.count; n++) c->rows[n] = todos[view.items[n]].uid;
+    c->row_count = view.count;
+    c->row_pos = c->rows_sent = 0;
+    c->block_count = c->block_pos = 0;
+    if (view_reads_archive()) {
+        c->query = view_plan.query;
+        c->blocks = xrealloc(c->blocks, archive_count * sizeof(uint64_t));
+        for (int n = 0; n < archive_count; n++) {
+            if (block_may_match(&archive[n].block, &c->query, view_now)) {
+                c->blocks[c->block_count++] = archive[n].block.id;
+            }
+        }
+    }
+    c->row_tag = frame->tag;
+    c->streaming = 1;
+}
+
+// Queues the next page of a query, and its end once every row is out.
+// Todos deleted since the query ran are left out. The archived rows follow
+// the view, a block at a time; a block thawed meanwhile is skipped.
+void serve_rows(Client *c) {
+    static char *page = NULL;
+    static size_t capacity = 0;
+
+    size_t size = 0;
+    int rows = 0;
+    while (c->row_pos < c->row_count && size < WIRE_PAGE_BYTES) {
+        int idx = find_todo(c->rows[c->row_pos++]);
+        if (idx < 0) continue;
+        const char *category = todo_category(idx);
+        size = pack_row(&page, &capacity, size, todos[idx].uid, todos[idx].due_date, todos[idx].done,
+                        todo_repeat(idx), todo_text(idx), todos[idx].text_len, category,
+                        strlen(category));
+        rows++;
+    }
+    while (c->row_pos == c->row_count && c->block_pos < c->block_count && size < WIRE_PAGE_BYTES) {
+        uint64_t id = c->blocks[c->block_pos++];
+        int n = 0;
+        while (n < archive_count && archive[n].block.id != id) n++;
+        const char *raw = n < archive_count ? unpack_block(n) : NULL;
+        size_t pos = 0;
+        RestoreEntry entry;
+        const char *text;
+        while (raw && (text = next_archive_entry(raw, archive[n].block.raw_size, &pos, &entry))) {
+            if (find_slot(entry.uid) >= 0 || !entry_matches(&c->query, &entry, text)) continue;
+            size = pack_row(&page, &capacity, size, entry.uid, entry.due_date, entry.done,
+                            entry.repeat, text, entry.text_len, text + entry.text_len,
+                            entry.category_len);
+            rows++;
+        }
+    }
+    if (rows > 0) client_reply(c, WIRE_ROWS, c->row_tag, rows, page, size);
+    c->rows_sent += rows;
+
+    if (c->row_pos == c->row_count && c->block_pos == c->block_count) {
+        client_reply(c, WIRE_OK, c->row_tag, c->rows_sent, NULL, 0);
+        c->streaming = 0;
+    }
+}
+
+// Adds a row at size in *page, growing it as needed; returns the new size
+size_t pack_row(char **page, size_t *capacity, size_t size, uint64_t uid, int64_t due_date, int done,
+                uint32_t repeat, const char *text, uint16_t text_len, const char *category,
+                uint16_t category_len) {
+    size_t row = WIRE_ROW_HEADER + text_len + category_len;
+    if (size + row > *capacity) {
+        *capacity = (size + row) * 2 + WIRE_PAGE_BYTES;
+        *page = xrealloc(*page, *capacity);
+    }
+    char *pos = *page + size;
+    memcpy(pos, &uid, 8);
+    memcpy(pos + 8, &due_date, 8);
+    pos[16] = done != 0;
+    memcpy(pos + 17, &text_len, 2);
+    memcpy(pos + 19, &category_len, 2);
+    memcpy(pos + 21, &repeat, 4);
+    memcpy(pos + WIRE_ROW_HEADER, text, text_len);
+    memcpy(pos + WIRE_ROW_HEADER + text_len, category, category_len);
+    return size + row;
+}
+
+// Times the engine on synthetic stores of each size in --todos, in a
+// scratch directory so the real store is never touched. Each operation
+// reports the median and 99th percentile latency of its samples and its
+// throughput in items per second.
+int command_bench(int argc, char **argv) {
+    int sizes[16] = {10000, 100000, 1000000};
+    int size_count = 3;
+    int runs = BENCH_RUNS;
+    for (int a = 0; a < argc; a++) {
+        if (strncmp(argv[a], "--todos=", 8) == 0) {
+            size_count = 0;
+            for (char *pos = argv[a] + 8; *pos && size_count < 16; pos += *pos == ',') {
+                long size = strtol(pos, &pos, 10);
+                if (size < 1 || size > INT32_MAX / 2 || (*pos && *pos != ',')) size_count = 16;
+                if (size_count < 16) sizes[size_count++] = size;
+            }
+            if (size_count == 16) size_count = 0;
+        } else if (strncmp(argv[a], "--runs=", 7) == 0 && atoi(argv[a] + 7) > 0) {
+            runs = atoi(argv[a] + 7);
+        } else if (strncmp(argv[a], "--seed=", 7) == 0 && strtoull(argv[a] + 7, NULL, 10) > 0) {
+            bench_state = strtoull(argv[a] + 7, NULL, 10);
+        } else {
+            size_count = 0;
+        }
+        if (size_count == 0) {
+            fprintf(stderr, "usage: app bench [--todos=N,...] [--runs=N] [--seed=N]\n");
+            return 2;
+        }
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/todo-bench-XXXXXX", tmp && tmp[0] ? tmp : "/tmp");
+    if (!mkdtemp(dir) || chdir(dir) != 0) {
+        perror(dir);
+        return 1;
+    }
+
+    int max_size = 0;
+    for (int n = 0; n < size_count; n++) {
+        if (sizes[n] > max_size) max_size = sizes[n];
+    }
+    int sample_count = runs > BENCH_DRAWS ? runs : BENCH_DRAWS;
+    if (sample_count < BENCH_DELETES) sample_count = BENCH_DELETES;
+    double *samples = xrealloc(NULL, sample_count * sizeof(double));
+
+    printf("%-9s %-26s %8s %10s %10s %12s\n", "todos", "operation", "samples", "p50", "p99", "items/s");
+    for (int n = 0; n < size_count; n++) {
+        int todos_wanted = sizes[n];
+        reset_store();
+
+        double start = bench_now();
+        bench_generate(todos_wanted);
+        samples[0] = bench_now() - start;
+        bench_report(todos_wanted, "generate", samples, 1, todos_wanted);
+
+        StoreImage image = live_image();
+        for (int r = 0; r < runs; r++) {
+            start = bench_now();
+            save_todos(&image);
+            samples[r] = bench_now() - start;
+        }
+        bench_report(todos_wanted, "save_todos", samples, runs, todos_wanted);
+
+        for (int r = 0; r < runs; r++) {
+            reset_store();
+            start = bench_now();
+            open_store();
+            samples[r] = bench_now() - start;
+            flock(fileno(journal), LOCK_UN);
+        }
+        bench_report(todos_wanted, "load_todos", samples, runs, todos_wanted);
+
+        start = bench_now();
+        build_indexes(INDEX_TRIGRAM | INDEX_DUE);
+        trigram_ready = due_ready = 1;
+        samples[0] = bench_now() - start;
+        bench_report(todos_wanted, "build indexes", samples, 1, todos_wanted);
+
+        bench_filters(todos_wanted, runs, samples);
+
+        // Deletes go through the persister, as in the TUI
+        start_persister();
+        int deletes = todos_wanted < BENCH_DELETES ? todos_wanted : BENCH_DELETES;
+        for (int d = 0; d < deletes; d++) {
+            int idx = bench_random() % todo_count;
+            while (todos[idx].flags & TODO_DELETED) idx = (idx + 1) % todo_count;
+            start = bench_now();
+            store_delete(idx);
+            journal_write(OP_DELETE, idx, 0, NULL, 0);
+            samples[d] = bench_now() - start;
+        }
+        bench_report(todos_wanted, "delete", samples, deletes, 1);
+        stop_persister();
+
+        bench_draw(todos_wanted, samples);
+        fflush(stdout);
+    }
+
+    reset_store();
+    unlink(DATA_FILE);
+    unlink(JOURNAL_FILE);
+    if (chdir("/") != 0 || rmdir(dir) != 0) perror(dir);
+    free(samples);
+    return 0;
+}
+
+uint64_t bench_random() {
+    bench_state ^= bench_state << 13;
+    bench_state ^= bench_state >> 7;
+    bench_state ^= bench_state << 17;
+    return bench_state;
+}
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills the store the way real lists look: texts of a few common words,
+// a quarter uncategorized and the rest over categories with a Zipf-like
+// skew, dates for three in five, clustered around now and mostly in the
+// next weeks, and the overdue todos more often done than the rest
+void bench_generate(int count) {
+    static const char *words[] = {
+        "review", "deploy", "fix", "write", "call", "email", "plan", "update", "order",
+        "book", "pay", "clean", "check", "draft", "send", "buy", "meeting", "report",
+        "invoice", "release", "notes", "dentist", "groceries", "budget", "slides",
+        "backup", "server", "client", "docs", "tests", "taxes", "flight", "garden",
+        "laundry", "birthday", "renewal", "contract", "roadmap", "interview", "migration",
+    };
+    size_t word_count = sizeof(words) / sizeof(words[0]);
+
+    double weights[BENCH_CATEGORIES], total = 0;
+    for (int c = 0; c < BENCH_CATEGORIES; c++) total += weights[c] = 1.0 / (c + 1);
+
+    time_t now = time(NULL);
+    for (int i = 0; i < count; i++) {
+        char text[MAX_LENGTH];
+        size_t len = 0;
+        int word_total = 2 + bench_random() % 6;
+        for (int w = 0; w < word_total && len < MAX_LENGTH - 16; w++) {
+            len += snprintf(text + len, MAX_LENGTH - len, "%s%s", w ? " " : "",
+                            words[bench_random() % word_count]);
+        }
+        if (bench_random() % 4 == 0) len += snprintf(text + len, MAX_LENGTH - len, " #%d", i);
+        int idx = store_add(text, len, next_uid(), now - (count - i));
+
+        if (bench_random() % 4 != 0) {
+            double pick = (bench_random() % 1000000) / 1e6 * total;
+            int c = 0;
+            while (c < BENCH_CATEGORIES - 1 && (pick -= weights[c]) > 0) c++;
+            char name[32];
+            int name_len = snprintf(name, sizeof(name), "%s-%d", words[c % word_count], c);
+            store_set_category(idx, name, name_len);
+        }
+
+        int overdue = 0;
+        if (bench_random() % 5 < 3) {
+            // Sum of three uniform offsets: a hump a week ahead, tails from
+            // a month back to two months out
+            int days = -30 + bench_random() % 31 + bench_random() % 31 + bench_random() % 31;
+            time_t due_date = (now / DAY_SECONDS + days) * DAY_SECONDS;
+            store_set_due_date(idx, due_date);
+            overdue = due_date < now;
+        }
+        if (bench_random() % 100 < (overdue ? 60 : 25)) store_set_done(idx, 1);
+    }
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Prints a row for count samples, each of which handled items todos
+void bench_report(int todos, const char *name, double *samples, int count, int items) {
+    double total = 0;
+    for (int n = 0; n < count; n++) total += samples[n];
+    qsort(samples, count, sizeof(double), compare_double);
+
+    char p50[16], p99[16];
+    double values[2] = {samples[count / 2], samples[(int)(count * 0.99)]};
+    char *out[2] = {p50, p99};
+    for (int v = 0; v < 2; v++) {
+        double t = values[v];
+        if (t < 1e-3) {
+            snprintf(out[v], 16, "%.1fus", t * 1e6);
+        } else if (t < 1) {
+            snprintf(out[v], 16, "%.2fms", t * 1e3);
+        } else {
+            snprintf(out[v], 16, "%.2fs", t);
+        }
+    }
+    printf("%-9d %-26s %8d %10s %10s %12.0f\n", todos, name, count, p50, p99,
+           total > 0 ? (double)items * count / total : 0);
+}
+
+// Rebuilds the view under the filters and searches the TUI offers
+void bench_filters(int todos, int runs, double *samples) {
+    static const struct {
+        const char *name;
+        int done, due, sort;
+        const char *category, *search, *query;
+    } cases[] = {
+        {"view: all", -1, DUE_ALL, SORT_NONE, "", "", ""},
+        {"view: pending", 0, DUE_ALL, SORT_NONE, "", "", ""},
+        {"view: category", -1, DUE_ALL, SORT_NONE, "deploy-1", "", ""},
+        {"view: overdue", -1, DUE_OVERDUE, SORT_NONE, "", "", ""},
+        {"view: pending by due", 0, DUE_ALL, SORT_DUE, "", "", ""},
+        {"view: all by text", -1, DUE_ALL, SORT_TEXT, "", "", ""},
+        {"view: query", -1, DUE_ALL, SORT_NONE, "", "", "cat:review-0 !done due<7d"},
+        {"search: common word", -1, DUE_ALL, SORT_NONE, "", "deploy", ""},
+        {"search: rare word", -1, DUE_ALL, SORT_NONE, "", "dentist birthday", ""},
+        {"search: short term", -1, DUE_ALL, SORT_NONE, "", "ta", ""},
+        {"search: no match", -1, DUE_ALL, SORT_NONE, "", "zebra", ""},
+    };
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        const char *error;
+        filter_done = cases[c].done;
+        filter_due = cases[c].due;
+        sort_mode = cases[c].sort;
+        snprintf(filter_category, MAX_LENGTH, "%s", cases[c].category);
+        snprintf(search_term, MAX_LENGTH, "%s", cases[c].search);
+        snprintf(filter_query, MAX_LENGTH, "%s", cases[c].query);
+        compile_query(filter_query, &filter_terms, &error);
+        for (int r = 0; r < runs; r++) {
+            double start = bench_now();
+            invalidate_view();
+            refresh_view();
+            samples[r] = bench_now() - start;
+        }
+        bench_report(todos, cases[c].name, samples, runs, todo_count);
+    }
+
+    filter_done = -1;
+    filter_due = DUE_ALL;
+    sort_mode = SORT_NONE;
+    filter_category[0] = search_term[0] = filter_query[0] = '\0';
+    filter_terms.count = 0;
+    invalidate_view();
+}
+
+// Draws the list on a virtual 50x160 screen whose output goes nowhere,
+// scrolling the cursor down a row per frame the way holding j does
+void bench_draw(int todos, double *samples) {
+    FILE *out = fopen("/dev/null", "w");
+    FILE *in = fopen("/dev/null", "r");
+    setenv("LINES", "50", 1);
+    setenv("COLUMNS", "160", 1);
+    SCREEN *screen = out && in ? newterm(getenv("TERM") ? NULL : "vt100", out, in) : NULL;
+    if (!screen) {
+        printf("%-9d %-26s %8s\n", todos, "draw_screen", "skipped: no terminal description");
+        if (out) fclose(out);
+        if (in) fclose(in);
+        return;
+    }
+    init_colors();
+
+    selected = scroll_top = 0;
+    draw_screen();
+    for (int d = 0; d < BENCH_DRAWS; d++) {
+        selected++;
+        double start = bench_now();
+        draw_screen();
+        samples[d] = bench_now() - start;
+    }
+    endwin();
+    delscreen(screen);
+    fclose(out);
+    fclose(in);
+    bench_report(todos, "draw_screen", samples, BENCH_DRAWS, 1);
+}
+
+#ifdef TODO_PROFILE
+int64_t profile_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profile_span_add(int span, int64_t ns) {
+    ProfileSpan *s = &profile_spans[span];
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->total_ns, ns, memory_order_relaxed);
+    atomic_store_explicit(&s->last_ns, ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&s->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&s->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+// Last and average time of each span on the blank row under the header.
+// The frame shown is the previous one, since this one is still drawing.
+void draw_profile() {
+    static const char *names[PROFILE_SPANS] = {"frame", "filter", "search", "io"};
+    char line[256];
+    int len = 0;
+    for (int span = 0; span < PROFILE_SPANS; span++) {
+        ProfileSpan *s = &profile_spans[span];
+        long long count = atomic_load_explicit(&s->count, memory_order_relaxed);
+        long long total = atomic_load_explicit(&s->total_ns, memory_order_relaxed);
+        len += snprintf(line + len, sizeof(line) - len, "%s %.2f/%.2fms | ", names[span],
+                        atomic_load_explicit(&s->last_ns, memory_order_relaxed) / 1e6,
+                        count ? total / 1e6 / count : 0.0);
+    }
+    snprintf(line + len, sizeof(line) - len, "scanned %lld drawn %d | written %lldK",
+             profile_frame_scanned, profile_frame_drawn,
+             atomic_load_explicit(&profile_bytes, memory_order_relaxed) >> 10);
+    attron(A_DIM);
+    mvaddnstr(2, 0, line, COLS);
+    attroff(A_DIM);
+}
+
+void dump_profile() {
+    static const char *names[PROFILE_SPANS] = {"frame", "filter", "search", "io"};
+    FILE *file = fopen(profile_file, "w");
+    if (!file) {
+        perror(profile_file);
+        return;
+    }
+    fprintf(file, "%-8s %10s %12s %12s %12s\n", "span", "count", "total_ms", "avg_us", "max_us");
+    for (int span = 0; span < PROFILE_SPANS; span++) {
+        ProfileSpan *s = &profile_spans[span];
+        long long count = atomic_load(&s->count);
+        long long total = atomic_load(&s->total_ns);
+        fprintf(file, "%-8s %10lld %12.2f %12.1f %12.1f\n", names[span], count, total / 1e6,
+                count ? total / 1e3 / count : 0.0, atomic_load(&s->max_ns) / 1e3);
     }
+    fprintf(file, "scanned %lld\nbytes_written %lld\n", atomic_load(&profile_scanned),
+            atomic_load(&profile_bytes));
+    fclose(file);
 }
+#endif